@@ -0,0 +1,181 @@
+#include "history.h"
+#include "terminal.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// headless checks of the alternate screen, DEC modes 47, 1047 and 1049
+// runs on plain linux, no napi, hilog or egl involved. exits with 1 if any check fails
+//
+// usage: alternate_screen_test
+
+static int failures = 0;
+
+static void Feed(term_session &session, const std::string &data) {
+    session.ParseOutput((const uint8_t *)data.data(), data.size());
+}
+
+static void Resize(term_session &session, int rows, int cols) {
+    session.term_row = rows;
+    session.term_col = cols;
+    session.ResizeTerminal();
+}
+
+static std::string Text(const std::vector<term_char> &cells) {
+    std::string text;
+    for (const term_char &c : cells) {
+        text += (char)c.ch;
+    }
+    while (!text.empty() && text.back() == ' ') {
+        text.pop_back();
+    }
+    return text;
+}
+
+static void Check(const char *name, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n", name);
+        failures++;
+    }
+}
+
+static void CheckCursor(const char *name, term_session &session, int row, int col) {
+    if (session.row != row || session.col != col) {
+        fprintf(stderr, "FAIL %s: cursor at %d,%d, expected %d,%d\n", name, session.row, session.col, row, col);
+        failures++;
+    }
+}
+
+// rows and columns of the screen shown
+static void CheckSize(const char *name, term_session &session, int rows, int cols) {
+    bool ok = session.terminal.size() == rows;
+    for (int i = 0; ok && i < rows; i++) {
+        ok = (int)session.terminal.Row(i).size() == cols;
+    }
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: screen is not %dx%d\n", name, rows, cols);
+        failures++;
+    }
+}
+
+// output of a full-screen application, scrolling the alternate screen by far more than its height
+static std::string FullScreenOutput() {
+    std::string data;
+    for (int i = 0; i < 50; i++) {
+        data += "frame " + std::to_string(i) + "\r\n";
+    }
+    return data;
+}
+
+// whatever scrolls off the alternate screen is lost, history only has the lines of the main screen
+static void TestNoHistory() {
+    for (const char *mode : {"47", "1047", "1049"}) {
+        term_session session;
+        Resize(session, 5, 20);
+        Feed(session, "a\r\nb\r\nc\r\nd\r\ne\r\nf\r\n");
+        uint64_t pushed = session.history->pushed;
+        int size = session.history->size();
+
+        Feed(session, std::string("\x1b[?") + mode + "h");
+        Feed(session, FullScreenOutput());
+        // scrolled up by SU and deleted by DL as well
+        Feed(session, "\x1b[3S\x1b[1;1H\x1b[2M");
+        std::string name = std::string("mode ") + mode + " pushes nothing to history";
+        Check(name.c_str(), session.history->pushed == pushed && session.history->size() == size);
+
+        Feed(session, std::string("\x1b[?") + mode + "l");
+        name = std::string("mode ") + mode + " brings the main screen back";
+        Check(name.c_str(), Text(session.terminal.Row(0)) == "c" && Text(session.terminal.Row(3)) == "f");
+    }
+}
+
+// 47 keeps the alternate screen as it was, 1047 clears it when leaving and 1049 when entering
+static void TestClearing() {
+    term_session session;
+    Resize(session, 4, 10);
+    Feed(session, "main");
+
+    Feed(session, "\x1b[?47h");
+    Check("47 shows the alternate screen", Text(session.terminal.Row(0)) == "");
+    Feed(session, "\x1b[1;1Halt");
+    Feed(session, "\x1b[?47l");
+    Check("47 leaves the main screen alone", Text(session.terminal.Row(0)) == "main");
+    Feed(session, "\x1b[?47h");
+    Check("47 keeps the alternate screen", Text(session.terminal.Row(0)) == "alt");
+    Feed(session, "\x1b[?1047l");
+    Feed(session, "\x1b[?47h");
+    Check("1047 clears the alternate screen when leaving", Text(session.terminal.Row(0)) == "");
+    Feed(session, "\x1b[1;1Halt\x1b[?47l\x1b[?1049h");
+    Check("1049 clears the alternate screen when entering", Text(session.terminal.Row(0)) == "");
+    Feed(session, "\x1b[?1049l");
+    Check("1049 brings the main screen back", Text(session.terminal.Row(0)) == "main");
+}
+
+// 1049 saves the cursor and its style like DECSC on entering and restores them on leaving
+static void TestCursor() {
+    term_session session;
+    Resize(session, 10, 40);
+    Feed(session, "$ \x1b[1mvi\x1b[0m\r\n$ ");
+    CheckCursor("cursor, before", session, 1, 2);
+
+    Feed(session, "\x1b[31m\x1b[?1049h");
+    Feed(session, "\x1b[0m\x1b[8;30Hstatus");
+    CheckCursor("cursor, on the alternate screen", session, 7, 35);
+
+    Feed(session, "\x1b[?1049l");
+    CheckCursor("1049 restores the cursor", session, 1, 2);
+    Feed(session, "x");
+    Check("1049 restores the style", session.terminal.Row(1)[2].style.fg == 1);
+
+    // DECSC on the alternate screen has a cursor of its own, the one saved by 1049 survives it
+    Feed(session, "\x1b[?1049h\x1b[3;3H\x1b" "7\x1b[5;5H\x1b" "8");
+    CheckCursor("DECRC on the alternate screen", session, 2, 2);
+    Feed(session, "\x1b[?1049l");
+    CheckCursor("1049 restores the cursor after DECSC", session, 1, 3);
+}
+
+// a resize on the alternate screen resizes the main screen too, and reflows it
+static void TestResize() {
+    term_session session;
+    Resize(session, 6, 20);
+    Feed(session, "one\r\n0123456789abcdefghij0123\r\n$ ");
+    Feed(session, "\x1b[?1049h");
+    Feed(session, FullScreenOutput());
+
+    Resize(session, 8, 10);
+    CheckSize("resize, alternate screen", session, 8, 10);
+    Check("resize keeps history untouched", session.history->size() == 0);
+    // the application redraws after SIGWINCH, which may go past the old size
+    Feed(session, "\x1b[8;10H");
+    CheckCursor("resize, cursor moves on the new alternate screen", session, 7, 9);
+
+    Feed(session, "\x1b[?1049l");
+    CheckSize("resize, main screen", session, 8, 10);
+    Check("resize reflows the main screen", Text(session.terminal.Row(0)) == "one" &&
+                                                Text(session.terminal.Row(1)) == "0123456789" &&
+                                                Text(session.terminal.Row(2)) == "abcdefghij" &&
+                                                Text(session.terminal.Row(3)) == "0123" &&
+                                                Text(session.terminal.Row(4)) == "$");
+    CheckCursor("resize, cursor restored on the main screen", session, 4, 2);
+
+    // and narrowing while on the alternate screen
+    Feed(session, "\x1b[?1049h");
+    Resize(session, 3, 5);
+    CheckSize("narrowing, alternate screen", session, 3, 5);
+    Feed(session, "\x1b[?1049l");
+    CheckSize("narrowing, main screen", session, 3, 5);
+    CheckCursor("narrowing, cursor restored on the main screen", session, 2, 2);
+}
+
+int main() {
+    TestNoHistory();
+    TestClearing();
+    TestCursor();
+    TestResize();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include "history.h"
+#include "search.h"
+#include "terminal.h"
+#include "trace.h"
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// headless replay benchmark for the escape sequence parser, utf8 decoder and the character grid
+// runs on plain linux, no napi, hilog or egl involved
+//
+// usage: benchmark [-n iterations] [-c chunk size] [-r rows] [-l cols] [-s synthetic size] [-t trace file]
+//                  [-b history budget] [-d spill dir] [-f search pattern] [-i] [-e] [recording...]
+//
+// recordings are raw pty byte streams, e.g. captured on a linux host via:
+//   script -q -O ls.rec -c "ls --color=always -lR /usr"
+// (remove the "Script started" header line) or on device by `cat`ing a file in termony.
+// if no recording is given, a set of synthetic workloads is generated instead
+// with -f, the history left by each workload is searched for the pattern, ignoring case with -i and as a regular
+// expression with -e
+
+// the terminal all workloads are replayed into
+static term_session session;
+
+static uint64_t NowNsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void Append(std::vector<uint8_t> &data, const char *s) { data.insert(data.end(), s, s + strlen(s)); }
+
+// plain ascii, like a build log
+static void GenerateAscii(std::vector<uint8_t> &data, size_t size) {
+    char line[256];
+    for (int i = 0; data.size() < size; i++) {
+        snprintf(line, sizeof(line),
+                 "[%d/4096] Building CXX object src/CMakeFiles/termony.dir/module_%d.cpp.o -O2 -Wall -Wextra\r\n",
+                 i % 4096, i);
+        Append(data, line);
+    }
+}
+
+// sgr heavy, like `ls --color`
+static void GenerateSgr(std::vector<uint8_t> &data, size_t size) {
+    char line[256];
+    for (int i = 0; data.size() < size; i++) {
+        snprintf(line, sizeof(line),
+                 "\x1b[0m\x1b[01;34mdir_%d\x1b[0m  \x1b[01;32mrun_%d.sh\x1b[0m  \x1b[31mpkg_%d.tar\x1b[0m  "
+                 "\x1b[01;36mlink_%d\x1b[0m  file_%d.txt\r\n",
+                 i, i, i, i, i);
+        Append(data, line);
+    }
+}
+
+// multi byte utf8, e.g. cjk text
+static void GenerateUtf8(std::vector<uint8_t> &data, size_t size) {
+    while (data.size() < size) {
+        Append(data, "终端模拟器性能测试，包含中文字符与 ASCII 混排。Ünïcödé ✓ → λ 🙂\r\n");
+    }
+}
+
+// full screen redraw with cursor movement, like htop
+static void GenerateCursor(std::vector<uint8_t> &data, size_t size) {
+    char line[256];
+    for (int i = 0; data.size() < size; i++) {
+        snprintf(line, sizeof(line), "\x1b[%d;1H\x1b[K\x1b[30;42m%5d\x1b[0m root  20   0 \x1b[1m%6d\x1b[0m S %4.1f%%",
+                 i % 24 + 1, i, i * 7 % 100000, (i % 1000) / 10.0);
+        Append(data, line);
+    }
+}
+
+static bool ReadFile(const char *path, std::vector<uint8_t> &data) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buffer[65536];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 5;
+    // what TerminalWorker parses in one batch when the pty reader is a little ahead of it
+    size_t chunk = 64 * 1024;
+    size_t synthetic_size = 16 * 1024 * 1024;
+    // record a trace like TerminalWorker does, and dump it at exit
+    const char *trace_path = nullptr;
+    const char *search_text = nullptr;
+    int search_flags = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:r:l:s:t:b:d:f:ie")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'c':
+            chunk = atol(optarg);
+            break;
+        case 'r':
+            session.term_row = atoi(optarg);
+            break;
+        case 'l':
+            session.term_col = atoi(optarg);
+            break;
+        case 's':
+            synthetic_size = atol(optarg);
+            break;
+        case 'b':
+            session.history->SetBudget(atol(optarg));
+            break;
+        case 'd':
+            session.history->SetSpill(optarg, (size_t)1024 * 1024 * 1024);
+            break;
+        case 't':
+            trace_path = optarg;
+            SetTraceEnabled(true);
+            break;
+        case 'f':
+            search_text = optarg;
+            break;
+        case 'i':
+            search_flags |= search_ignore_case;
+            break;
+        case 'e':
+            search_flags |= search_regex;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n iterations] [-c chunk size] [-r rows] [-l cols] [-s synthetic size] "
+                    "[-t trace file] [-b history budget] [-d spill dir] [-f search pattern] [-i] [-e] [recording...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (iterations < 1 || chunk < 1 || session.term_row < 1 || session.term_col < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    search_pattern pattern;
+    if (search_text && !pattern.Compile(search_text, search_flags)) {
+        fprintf(stderr, "Invalid search pattern\n");
+        return 1;
+    }
+
+    // replies to the application go nowhere
+    session.fd = open("/dev/null", O_WRONLY);
+    assert(session.fd != -1);
+    session.ResizeTerminal();
+
+    std::vector<std::string> names;
+    for (int i = optind; i < argc; i++) {
+        names.push_back(argv[i]);
+    }
+    bool synthetic = names.empty();
+    if (synthetic) {
+        names = {"ascii", "sgr", "utf8", "cursor"};
+    }
+
+    // peak rss includes the replayed stream itself, which is loaded into memory upfront
+    printf("%-24s %10s %10s %10s %12s %12s %12s %12s\n", "workload", "bytes", "MB/s", "ns/byte", "peak rss KB",
+           "hist lines", "hist KB", "spill KB");
+    for (auto &name : names) {
+        std::vector<uint8_t> data;
+        if (!synthetic) {
+            if (!ReadFile(name.c_str(), data)) {
+                fprintf(stderr, "Failed to read %s\n", name.c_str());
+                return 1;
+            }
+        } else if (name == "ascii") {
+            GenerateAscii(data, synthetic_size);
+        } else if (name == "sgr") {
+            GenerateSgr(data, synthetic_size);
+        } else if (name == "utf8") {
+            GenerateUtf8(data, synthetic_size);
+        } else if (name == "cursor") {
+            GenerateCursor(data, synthetic_size);
+        }
+
+        uint64_t total_bytes = 0;
+        uint64_t begin = NowNsec();
+        for (int i = 0; i < iterations; i++) {
+            // feed in read()-sized chunks, so that sequences get split across calls like on device
+            // and publish a snapshot for the renderer and flush replies after each, like TerminalWorker does
+            for (size_t off = 0; off < data.size(); off += chunk) {
+                size_t length = std::min(chunk, data.size() - off);
+                TraceBytes(data.data() + off, length);
+                session.ParseOutput(data.data() + off, length);
+                session.PublishSnapshot();
+                session.FlushWriteQueue();
+            }
+            total_bytes += data.size();
+        }
+        uint64_t elapsed = NowNsec() - begin;
+
+        struct rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+        printf("%-24s %10lu %10.2f %10.2f %12ld %12d %12lu %12lu\n", name.c_str(), (unsigned long)total_bytes,
+               (double)total_bytes / 1024 / 1024 / ((double)elapsed / 1e9), (double)elapsed / total_bytes,
+               usage.ru_maxrss, session.history->size(), (unsigned long)session.history->MemoryUsage() / 1024,
+               (unsigned long)session.history->SpillUsage() / 1024);
+
+        if (search_text) {
+            // in batches like the search thread does, but through all of history, however many matches there are
+            std::vector<search_match> matches;
+            uint64_t end = session.history->pushed;
+            begin = NowNsec();
+            while (SearchHistory(session.history.get(), pattern, &end, 4096, SIZE_MAX, matches)) {
+            }
+            elapsed = NowNsec() - begin;
+            printf("%-24s %10lu matches in %lu lines, %.2f ms\n", "  search", (unsigned long)matches.size(),
+                   (unsigned long)(session.history->pushed - end), (double)elapsed / 1e6);
+        }
+    }
+
+    if (trace_path) {
+        int trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (trace_fd == -1) {
+            fprintf(stderr, "Failed to open %s\n", trace_path);
+            return 1;
+        }
+        TraceDump(trace_fd);
+        close(trace_fd);
+    }
+
+    close(session.fd);
+    return 0;
+}
@@ -0,0 +1,522 @@
+#include "history.h"
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HISTORY_CHUNK_SIZE (64 * 1024)
+// spill segment files grow up to this size and are mapped whole, must hold the largest chunk
+#define SEGMENT_SIZE (64 * 1024 * 1024)
+// num_cells, num_runs, text_bytes
+#define LINE_HEADER_SIZE 6
+// or'ed into num_cells of a soft-wrapped line
+#define LINE_WRAPPED 0x8000
+// style, length
+#define RUN_SIZE 6
+
+static std::atomic<int> next_history_id(0);
+
+term_history::term_history() : id(next_history_id++) {}
+
+static uint32_t StyleBits(const style &s) {
+    uint32_t bits;
+    memcpy(&bits, &s, sizeof(bits));
+    return bits;
+}
+
+static int EncodeUtf8(uint32_t codepoint, uint8_t *out) {
+    if (codepoint < 0x80) {
+        out[0] = codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = 0xc0 | (codepoint >> 6);
+        out[1] = 0x80 | (codepoint & 0x3f);
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = 0xe0 | (codepoint >> 12);
+        out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+        out[2] = 0x80 | (codepoint & 0x3f);
+        return 3;
+    } else {
+        out[0] = 0xf0 | (codepoint >> 18);
+        out[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+        out[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+        out[3] = 0x80 | (codepoint & 0x3f);
+        return 4;
+    }
+}
+
+// the text was encoded by EncodeUtf8, so it is well-formed
+static uint32_t DecodeUtf8(const uint8_t *&p) {
+    uint8_t byte = *p++;
+    if (byte < 0x80) {
+        return byte;
+    } else if (byte < 0xe0) {
+        uint32_t codepoint = (byte & 0x1f) << 6;
+        return codepoint | (*p++ & 0x3f);
+    } else if (byte < 0xf0) {
+        uint32_t codepoint = (byte & 0x0f) << 12;
+        codepoint |= (*p++ & 0x3f) << 6;
+        return codepoint | (*p++ & 0x3f);
+    } else {
+        uint32_t codepoint = (byte & 0x07) << 18;
+        codepoint |= (*p++ & 0x3f) << 12;
+        codepoint |= (*p++ & 0x3f) << 6;
+        return codepoint | (*p++ & 0x3f);
+    }
+}
+
+void term_history::Push(const term_char *cells, int count, bool wrapped) {
+    pthread_mutex_lock(&mutex);
+    // trim trailing blanks in default style, in a wrapped line they are part of the text
+    uint32_t blank_style = StyleBits(style());
+    while (!wrapped && count > 0 && cells[count - 1].ch == ' ' && StyleBits(cells[count - 1].style) == blank_style) {
+        count--;
+    }
+    assert(count < LINE_WRAPPED);
+
+    // upper bound of encoded size
+    int num_runs = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || StyleBits(cells[i].style) != StyleBits(cells[i - 1].style)) {
+            num_runs++;
+        }
+    }
+    size_t max_size = LINE_HEADER_SIZE + num_runs * RUN_SIZE + count * 4;
+
+    if (chunks.empty() || chunks.back().capacity - chunks.back().used < max_size) {
+        // start a new chunk, large lines get a chunk of their own
+        size_t capacity = max_size > HISTORY_CHUNK_SIZE ? max_size : HISTORY_CHUNK_SIZE;
+        chunk c;
+        if (spare.data && spare.capacity >= capacity) {
+            c = std::move(spare);
+            c.used = 0;
+            c.num_lines = 0;
+            c.colors.reset();
+        } else {
+            c.data.reset(new uint8_t[capacity]);
+            c.capacity = capacity;
+        }
+        chunk_bytes += c.capacity;
+        chunks.push_back(std::move(c));
+    }
+
+    chunk &c = chunks.back();
+    uint8_t *begin = c.data.get() + c.used;
+    uint8_t *p = begin + LINE_HEADER_SIZE + num_runs * RUN_SIZE;
+    uint8_t *run = begin + LINE_HEADER_SIZE;
+    uint8_t *text = p;
+    for (int i = 0; i < count;) {
+        // one style run
+        uint32_t bits = StyleBits(cells[i].style);
+        int length = 0;
+        while (i < count && StyleBits(cells[i].style) == bits) {
+            p += EncodeUtf8(cells[i].ch, p);
+            length++;
+            i++;
+        }
+        uint16_t length16 = length;
+        c.colors[cells[i - 1].style.fg] = true;
+        c.colors[cells[i - 1].style.bg] = true;
+        memcpy(run, &bits, 4);
+        memcpy(run + 4, &length16, 2);
+        run += RUN_SIZE;
+    }
+
+    uint16_t header[3] = {(uint16_t)(count | (wrapped ? LINE_WRAPPED : 0)), (uint16_t)num_runs, (uint16_t)(p - text)};
+    memcpy(begin, header, sizeof(header));
+
+    lines.push_back({first_chunk_seq + (uint32_t)chunks.size() - 1, (uint32_t)c.used});
+    c.used = p - c.data.get();
+    c.num_lines++;
+    stored++;
+    pushed++;
+
+    EnforceBudget();
+    pthread_mutex_unlock(&mutex);
+}
+
+static int NumCells(const uint8_t *begin) {
+    uint16_t num_cells;
+    memcpy(&num_cells, begin, sizeof(num_cells));
+    return num_cells & ~LINE_WRAPPED;
+}
+
+static bool IsWrapped(const uint8_t *begin) {
+    uint16_t num_cells;
+    memcpy(&num_cells, begin, sizeof(num_cells));
+    return num_cells & LINE_WRAPPED;
+}
+
+// append the cells of a line to out
+static void DecodeLine(const uint8_t *begin, std::vector<term_char> &out) {
+    uint16_t header[3];
+    memcpy(header, begin, sizeof(header));
+    size_t cell = out.size();
+    out.resize(cell + (header[0] & ~LINE_WRAPPED));
+
+    const uint8_t *run = begin + LINE_HEADER_SIZE;
+    const uint8_t *text = run + header[1] * RUN_SIZE;
+    for (int i = 0; i < header[1]; i++, run += RUN_SIZE) {
+        style s;
+        uint16_t length;
+        memcpy(&s, run, 4);
+        memcpy(&length, run + 4, 2);
+        for (int j = 0; j < length; j++, cell++) {
+            out[cell].ch = DecodeUtf8(text);
+            out[cell].style = s;
+        }
+    }
+}
+
+// encoded line numbered as by stored, which must not be dropped
+const uint8_t *term_history::LineData(uint64_t line) const {
+    int index = line - (stored - size());
+    assert(index >= 0 && index < size());
+    if (index < (int)spilled_lines.size()) {
+        // touching the mapping pages the line in from disk
+        const line_ref &ref = spilled_lines[index];
+        return segments[ref.chunk_seq - first_segment_seq].data + ref.offset;
+    }
+    const line_ref &ref = lines[index - spilled_lines.size()];
+    return chunks[ref.chunk_seq - first_chunk_seq].data.get() + ref.offset;
+}
+
+void term_history::Get(int index, std::vector<term_char> &out) const {
+    out.clear();
+    DecodeLine(LineData(stored - size() + index), out);
+}
+
+// display rows, including lines not rewrapped yet as one row each
+int term_history::Rows() const {
+    uint64_t first_line = stored - size();
+    if (first_line >= reflow_end) {
+        return size();
+    }
+    return (stored - reflow_end) + rewrapped.size() + (rewrapped_begin - first_line);
+}
+
+// rewrap lines from the bottom up until there are count rewrapped rows, returns false if there are fewer lines
+bool term_history::Rewrap(uint64_t count) {
+    uint64_t first_line = stored - size();
+    std::vector<row_ref> rows;
+    while (rewrapped.size() < count && rewrapped_begin > first_line) {
+        // the wrapped line ending above rewrapped_begin starts after the closest line before it that does not wrap
+        uint64_t end = rewrapped_begin;
+        uint64_t begin = end - 1;
+        while (begin > first_line && IsWrapped(LineData(begin - 1))) {
+            begin--;
+        }
+        // a row starts every width cells, an empty line still takes one
+        rows.clear();
+        uint64_t next = 0;
+        uint64_t offset = 0;
+        for (uint64_t line = begin; line < end; line++) {
+            int num_cells = NumCells(LineData(line));
+            for (; next < offset + num_cells; next += width) {
+                rows.push_back({line, (uint32_t)(next - offset)});
+            }
+            offset += num_cells;
+        }
+        if (rows.empty()) {
+            rows.push_back({begin, 0});
+        }
+        rewrapped.insert(rewrapped.end(), rows.rbegin(), rows.rend());
+        rewrapped_begin = begin;
+    }
+    return rewrapped.size() >= count;
+}
+
+bool term_history::GetLine(uint64_t line, std::vector<term_char> &out) {
+    pthread_mutex_lock(&mutex);
+    // rows from the bottom, rows pushed since the width change are lines as they are
+    uint64_t back = pushed - 1 - line;
+    uint64_t recent = stored - std::max(reflow_end, stored - size());
+    bool found = false;
+    if (back < recent) {
+        Get(size() - 1 - back, out);
+        found = true;
+    } else if (back < (uint64_t)Rows() && Rewrap(back - recent + 1)) {
+        // the row starts within a line, and continues into the lines it wraps into
+        const row_ref &ref = rewrapped[back - recent];
+        out.clear();
+        DecodeLine(LineData(ref.line), out);
+        out.erase(out.begin(), out.begin() + ref.offset);
+        for (uint64_t next = ref.line + 1; (int)out.size() < width && next < reflow_end; next++) {
+            if (!IsWrapped(LineData(next - 1))) {
+                break;
+            }
+            DecodeLine(LineData(next), out);
+        }
+        if ((int)out.size() > width) {
+            out.resize(width);
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
+
+// stored number of the line numbered line, false if it was taken back
+bool term_history::Stored(uint64_t line, uint64_t *index) const {
+    // the first gap after line, and the one before, which line is numbered after
+    auto it = std::upper_bound(gaps.begin(), gaps.end(), line, [](uint64_t n, const gap &g) { return n < g.line; });
+    uint64_t skipped = it == gaps.begin() ? 0 : (it - 1)->skipped;
+    *index = line - skipped;
+    return it == gaps.end() || *index < it->line - it->skipped;
+}
+
+bool term_history::GetTextBefore(uint64_t *line, std::string &out, bool *wrapped) {
+    pthread_mutex_lock(&mutex);
+    uint64_t index;
+    if (!Stored(*line - 1, &index)) {
+        // within a gap, go to the line before it, there is always one as gaps never touch
+        auto it = std::upper_bound(gaps.begin(), gaps.end(), *line - 1,
+                                   [](uint64_t n, const gap &g) { return n < g.line; });
+        *line = it->line - (it->skipped - (it == gaps.begin() ? 0 : (it - 1)->skipped));
+        Stored(*line - 1, &index);
+    }
+    *line -= 1;
+    bool found = index - (stored - size()) < (uint64_t)size();
+    if (found) {
+        const uint8_t *begin = LineData(index);
+        uint16_t header[3];
+        memcpy(header, begin, sizeof(header));
+        const uint8_t *text = begin + LINE_HEADER_SIZE + header[1] * RUN_SIZE;
+        out.append((const char *)text, header[2]);
+        *wrapped = header[0] & LINE_WRAPPED;
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
+
+int term_history::RowsBefore(uint64_t line, int max_rows, int max_rewrap) {
+    pthread_mutex_lock(&mutex);
+    // lines not rewrapped yet count as one row each, which is only a guess when the width changed
+    int64_t below = (int64_t)(pushed - line);
+    int64_t recent = stored - std::max(reflow_end, stored - size());
+    if (below + max_rows > recent) {
+        int64_t count = below + max_rows - recent;
+        if (count - (int64_t)rewrapped.size() > max_rewrap && Rewrap(rewrapped.size() + max_rewrap)) {
+            // the rest is left for the next call
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+        Rewrap(count);
+    }
+    int rows = Rows() - (int)below;
+    pthread_mutex_unlock(&mutex);
+    return std::max(rows, 0);
+}
+
+bool term_history::LastWrapped() {
+    pthread_mutex_lock(&mutex);
+    bool wrapped = size() > 0 && IsWrapped(LineData(stored - 1));
+    pthread_mutex_unlock(&mutex);
+    return wrapped;
+}
+
+void term_history::SetWidth(int new_width) {
+    pthread_mutex_lock(&mutex);
+    if (new_width != width && width != 0) {
+        // the screen is reflowed on its own, so the last line must not wrap into it
+        if (!lines.empty()) {
+            uint8_t *last = chunks.back().data.get() + lines.back().offset;
+            uint16_t num_cells = NumCells(last);
+            memcpy(last, &num_cells, sizeof(num_cells));
+        }
+        reflow_end = stored;
+        rewrapped.clear();
+        rewrapped_begin = stored;
+        layout++;
+    }
+    width = new_width;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool term_history::PopLine(std::vector<term_char> &out) {
+    pthread_mutex_lock(&mutex);
+    if (lines.empty()) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    // spilled lines stay, a line wrapping into them is taken back in part
+    uint64_t first_line = stored - lines.size();
+    uint64_t begin = stored - 1;
+    while (begin > first_line && IsWrapped(LineData(begin - 1))) {
+        begin--;
+    }
+    for (uint64_t line = begin; line < stored; line++) {
+        DecodeLine(LineData(line), out);
+    }
+
+    // lines are appended to the last chunk, so they are removed from there
+    for (; stored > begin; stored--) {
+        chunk &c = chunks.back();
+        c.used = lines.back().offset;
+        c.num_lines--;
+        lines.pop_back();
+        if (c.num_lines == 0) {
+            chunk_bytes -= c.capacity;
+            if (c.capacity == HISTORY_CHUNK_SIZE) {
+                spare = std::move(c);
+            }
+            chunks.pop_back();
+        }
+    }
+
+    // their numbers are skipped, gaps taken back in whole are merged into this one
+    while (!gaps.empty() && gaps.back().line - gaps.back().skipped >= stored) {
+        gaps.pop_back();
+    }
+    gaps.push_back({pushed, pushed - stored});
+
+    // rewrapped rows may start in the lines taken back, so start over
+    reflow_end = stored;
+    rewrapped.clear();
+    rewrapped_begin = stored;
+    layout++;
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+// forget rewrapped rows and gaps of dropped lines
+void term_history::TrimDropped() {
+    uint64_t first_line = stored - size();
+    while (!rewrapped.empty() && rewrapped.back().line < first_line) {
+        rewrapped.pop_back();
+    }
+    rewrapped_begin = std::max(rewrapped_begin, first_line);
+    // the last gap before the first line still numbers the lines after it
+    while (gaps.size() > 1 && gaps[1].line - gaps[1].skipped <= first_line) {
+        gaps.pop_front();
+    }
+}
+
+void term_history::DropOldestChunk() {
+    assert(!chunks.empty());
+    chunk &c = chunks.front();
+    if (!spill_dir.empty()) {
+        Spill(c);
+    }
+    lines.erase(lines.begin(), lines.begin() + c.num_lines);
+    chunk_bytes -= c.capacity;
+    // keep a regular sized chunk for reuse
+    if (c.capacity == HISTORY_CHUNK_SIZE) {
+        spare = std::move(c);
+    }
+    chunks.pop_front();
+    first_chunk_seq++;
+    TrimDropped();
+}
+
+void term_history::EnforceBudget() {
+    // always keep the chunk being appended to
+    while (chunks.size() > 1 && MemoryUsage() > budget) {
+        DropOldestChunk();
+    }
+}
+
+void term_history::SetBudget(size_t bytes) {
+    pthread_mutex_lock(&mutex);
+    budget = bytes;
+    EnforceBudget();
+    // the spare chunk is only kept if it fits as well
+    if (MemoryUsage() + spare.capacity > budget) {
+        spare = chunk();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// create and map a new segment file, the file is unlinked right away so nothing is left behind on exit
+// lines are appended with pwrite and only read through the read-only mapping, so rss only grows by what is viewed
+static bool OpenSegment(const std::string &dir, int id, uint32_t seq, term_history::segment &s) {
+    std::string path =
+        dir + "/history-" + std::to_string(getpid()) + "-" + std::to_string(id) + "-" + std::to_string(seq);
+    s.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (s.fd == -1) {
+        return false;
+    }
+    unlink(path.c_str());
+    void *data = mmap(nullptr, SEGMENT_SIZE, PROT_READ, MAP_SHARED, s.fd, 0);
+    if (data == MAP_FAILED) {
+        close(s.fd);
+        return false;
+    }
+    s.data = (const uint8_t *)data;
+    return true;
+}
+
+void term_history::Spill(const chunk &c) {
+    assert(c.used <= SEGMENT_SIZE);
+    if (segments.empty() || SEGMENT_SIZE - segments.back().used < c.used) {
+        segment s;
+        if (!OpenSegment(spill_dir, id, first_segment_seq + segments.size(), s)) {
+            // not writable, stop spilling but keep what is already there
+            spill_dir.clear();
+            return;
+        }
+        segments.push_back(s);
+        while (segments.size() > 1 && SpillUsage() > spill_budget) {
+            DropOldestSegment();
+        }
+    }
+
+    segment &s = segments.back();
+    if (pwrite(s.fd, c.data.get(), c.used, s.used) != (ssize_t)c.used) {
+        // out of disk, the lines are dropped
+        spill_dir.clear();
+        return;
+    }
+    // lines of the oldest chunk are at the front of lines, and their offsets stay valid after a plain copy
+    uint32_t seq = first_segment_seq + segments.size() - 1;
+    for (int i = 0; i < c.num_lines; i++) {
+        spilled_lines.push_back({seq, (uint32_t)(s.used + lines[i].offset)});
+    }
+    s.used += c.used;
+    s.num_lines += c.num_lines;
+    s.colors |= c.colors;
+}
+
+void term_history::DropOldestSegment() {
+    assert(!segments.empty());
+    segment &s = segments.front();
+    spilled_lines.erase(spilled_lines.begin(), spilled_lines.begin() + s.num_lines);
+    munmap((void *)s.data, SEGMENT_SIZE);
+    close(s.fd);
+    segments.pop_front();
+    first_segment_seq++;
+    TrimDropped();
+}
+
+size_t term_history::SpillUsage() const {
+    size_t bytes = 0;
+    for (auto &s : segments) {
+        bytes += s.used;
+    }
+    return bytes;
+}
+
+void term_history::MarkColors(color_set &used) {
+    pthread_mutex_lock(&mutex);
+    for (const chunk &c : chunks) {
+        used |= c.colors;
+    }
+    for (const segment &s : segments) {
+        used |= s.colors;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void term_history::SetSpill(const std::string &dir, size_t max_bytes) {
+    pthread_mutex_lock(&mutex);
+    spill_dir = dir;
+    spill_budget = max_bytes;
+    while (!segments.empty() && (spill_dir.empty() || SpillUsage() > spill_budget)) {
+        DropOldestSegment();
+    }
+    pthread_mutex_unlock(&mutex);
+}
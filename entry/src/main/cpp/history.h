@@ -0,0 +1,185 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "terminal.h"
+#include <cstdint>
+#include <deque>
+#include <limits.h>
+#include <memory>
+#include <pthread.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// scrollback storage
+// each line is trimmed of trailing blanks and compressed into style runs plus utf8 text, then appended to an arena
+// of fixed-size chunks. when the memory budget is exceeded, the oldest chunk is dropped with all lines in it.
+// if spilling is enabled, dropped chunks are first appended as-is to segment files on disk, which are memory mapped
+// so the kernel pages lines in lazily when scrolled back to. the oldest segment is dropped at the disk budget.
+//
+// lines are stored at the width they were pushed with, and rewrapped to the current width only when displayed:
+// on a width change, lines already pushed are rewrapped lazily from the bottom up as GetLine reaches them, so a
+// resize costs nothing however long the scrollback is. display rows are numbered like lines, rows pushed since the
+// width change keep their line numbers and rewrapped rows count down from there. the numbers are unsigned and may
+// go below zero when narrowing, so only differences of them are compared.
+//
+// lines taken back by PopLine leave a gap in the line numbers, a number is never given to another line, so that a
+// search match keeps pointing at the line it was found in. internally lines are numbered without gaps, by stored.
+//
+// line layout within a chunk (native endian, unaligned):
+//   uint16_t num_cells, top bit set if the line is soft-wrapped into the next, uint16_t num_runs, uint16_t text_bytes
+//   num_runs * (uint32_t style, uint16_t length)
+//   text_bytes of utf8, one codepoint per cell
+//
+// the parser thread writes, the renderer reads lines by number through GetLine. both take mutex, which is only held
+// for a single line, a budget change or rewrapping the lines scrolled to, never for a whole read from the pty.
+struct term_history {
+    struct chunk {
+        std::unique_ptr<uint8_t[]> data;
+        size_t capacity = 0;
+        size_t used = 0;
+        int num_lines = 0;
+        // color indices the lines refer to
+        color_set colors;
+    };
+    // location of a line: sequence number of its chunk and offset within
+    struct line_ref {
+        uint32_t chunk_seq;
+        uint32_t offset;
+    };
+
+    std::deque<chunk> chunks;
+    // sequence number of chunks.front()
+    uint32_t first_chunk_seq = 0;
+    std::deque<line_ref> lines;
+    // sum of chunk capacities
+    size_t chunk_bytes = 0;
+    size_t budget = 16 * 1024 * 1024;
+    // a dropped chunk kept for reuse, to avoid allocation in steady state
+    chunk spare;
+
+    // spill tier, older than all lines in chunks
+    // segment files are named after the process and id, so that histories of several sessions do not collide
+    struct segment {
+        int fd = -1;
+        const uint8_t *data = nullptr;
+        size_t used = 0;
+        int num_lines = 0;
+        // color indices the lines of the chunks spilled here refer to
+        color_set colors;
+    };
+    // empty if spilling is disabled
+    std::string spill_dir;
+    int id;
+    std::deque<segment> segments;
+    // sequence number of segments.front()
+    uint32_t first_segment_seq = 0;
+    // chunk_seq is the segment sequence number here
+    std::deque<line_ref> spilled_lines;
+    size_t spill_budget = 0;
+
+    // reflow, see above
+    // width of display rows, 0 until set
+    int width = 0;
+    // lines before this one were pushed at another width
+    uint64_t reflow_end = 0;
+    // bumped on every width change, as rows get new numbers
+    uint64_t layout = 0;
+    // start of a rewrapped row: a line number and a cell within it
+    struct row_ref {
+        uint64_t line;
+        uint32_t offset;
+    };
+    // rewrapped rows from the bottom up, rewrapped[i] is the row i + 1 rows above line reflow_end
+    std::vector<row_ref> rewrapped;
+    // lines from here to reflow_end are rewrapped
+    uint64_t rewrapped_begin = 0;
+
+    // held by Push, GetLine, GetTextBefore, RowsBefore, LastWrapped, SetWidth, PopLine, SetBudget, SetSpill and
+    // MarkColors
+    mutable pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    // lines pushed since start, dropped ones and ones taken back included
+    // line numbers go up to pushed and are never reused, indices shift as old lines are dropped
+    uint64_t pushed = 0;
+    // the same, without lines taken back: line index + stored - size() numbers lines without gaps
+    // reflow_end, rewrapped_begin and row_ref count in these numbers
+    uint64_t stored = 0;
+    // from line number line on, line numbers are skipped above stored numbers, in increasing order
+    // the numbers before line that are skipped since the previous gap belong to lines taken back
+    struct gap {
+        uint64_t line;
+        uint64_t skipped;
+    };
+    std::deque<gap> gaps;
+
+    term_history();
+
+    // number of lines, including spilled ones
+    int size() const { return spilled_lines.size() + lines.size(); }
+
+    // append a line of cells, trailing blanks are trimmed unless the line wraps into the next one
+    void Push(const term_char *cells, int count, bool wrapped = false);
+
+    // decode the line at index, 0 is the oldest line
+    void Get(int index, std::vector<term_char> &out) const;
+
+    // decode the display row numbered as by pushed, from any thread
+    // returns false if the row was dropped or is not pushed yet
+    bool GetLine(uint64_t line, std::vector<term_char> &out);
+
+    // append the utf8 text of the line before the one numbered *line as by pushed to out, one codepoint per cell,
+    // and set *line to its number, from any thread. numbers of lines taken back are skipped
+    // the text is stored as is, so nothing is decoded. *wrapped is set if the line wraps into the next
+    // returns false if the line was dropped
+    bool GetTextBefore(uint64_t *line, std::string &out, bool *wrapped);
+
+    // number of display rows above the row numbered line, from any thread
+    // the max_rows rows above it are rewrapped first, so the number is exact unless it is larger than max_rows
+    // if more than max_rewrap rows are left to rewrap, only that many are and -1 is returned, call again to go on,
+    // so that the mutex is not held for long
+    int RowsBefore(uint64_t line, int max_rows, int max_rewrap = INT_MAX);
+
+    // whether the last line pushed wraps into the next, i.e. into the screen
+    bool LastWrapped();
+
+    // rewrap lines pushed so far to width when they are displayed, lines pushed from now on are that wide
+    // the last line no longer wraps
+    void SetWidth(int new_width);
+
+    // take back the last line and the lines that wrap into it, appending their cells to out
+    // so that a resized screen can fill up from history, or rewrap a line that wraps into it in one piece
+    // returns false if there is no line left in memory. rows get new numbers, as with a width change,
+    // while the numbers of the lines taken back are skipped
+    bool PopLine(std::vector<term_char> &out);
+
+    // add the color indices that any line refers to to used, without decoding the lines
+    void MarkColors(color_set &used);
+
+    // memory used by chunks, the line index and rewrapped rows
+    size_t MemoryUsage() const {
+        return chunk_bytes + lines.size() * sizeof(line_ref) + rewrapped.size() * sizeof(row_ref);
+    }
+
+    // disk used by spilled segments, their line index stays in memory
+    size_t SpillUsage() const;
+
+    // set the memory budget in bytes, dropping old lines if needed, the chunk being appended to is always kept
+    void SetBudget(size_t bytes);
+
+    // spill dropped chunks to segment files under dir, up to max_bytes on disk
+    // an empty dir disables spilling and discards spilled lines
+    void SetSpill(const std::string &dir, size_t max_bytes);
+
+    void DropOldestChunk();
+    void EnforceBudget();
+    void Spill(const chunk &c);
+    void DropOldestSegment();
+    const uint8_t *LineData(uint64_t line) const;
+    bool Stored(uint64_t line, uint64_t *index) const;
+    int Rows() const;
+    bool Rewrap(uint64_t count);
+    void TrimDropped();
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "rasterizer.h"
+#include "trace.h"
+#include <algorithm>
+#include <deque>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// codepoints rasterized per batch, so the first glyphs of a large request show up after a short delay
+#define RASTERIZE_BATCH 32
+
+// only touched by the worker after StartRasterizer
+static FT_Library ft;
+static FT_Face faces[NUM_WEIGHT];
+static void (*batch_done)() = nullptr;
+
+// protects the queues below
+static pthread_mutex_t rasterizer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<uint32_t> requests;
+static std::deque<glyph_bitmap> results;
+// a batch is being rasterized
+static bool busy = false;
+
+static void *RasterizerWorker(void *) {
+    pthread_setname_np(pthread_self(), "rasterizer");
+
+    std::vector<uint32_t> batch;
+    std::vector<glyph_bitmap> bitmaps;
+    while (1) {
+        pthread_mutex_lock(&rasterizer_lock);
+        while (requests.empty()) {
+            busy = false;
+            pthread_cond_broadcast(&idle_cond);
+            pthread_cond_wait(&request_cond, &rasterizer_lock);
+        }
+        busy = true;
+        size_t count = std::min(requests.size(), (size_t)RASTERIZE_BATCH);
+        batch.assign(requests.begin(), requests.begin() + count);
+        requests.erase(requests.begin(), requests.begin() + count);
+        pthread_mutex_unlock(&rasterizer_lock);
+
+        // rasterize without the lock, so queueing never waits for freetype
+        bitmaps.clear();
+        for (int weight = 0; weight < NUM_WEIGHT; weight++) {
+            FT_Face face = faces[weight];
+            for (uint32_t c : batch) {
+                glyph_bitmap glyph;
+                glyph.codepoint = c;
+                glyph.weight = (enum weight)weight;
+                if (!face || FT_Load_Char(face, c, FT_LOAD_RENDER) != 0) {
+                    // the glyph slot still holds the previous glyph, so this one is drawn blank instead
+                    glyph.left = 0;
+                    glyph.top = 0;
+                    glyph.width = 0;
+                    glyph.height = 0;
+                    bitmaps.push_back(std::move(glyph));
+                    continue;
+                }
+                const FT_Bitmap &bitmap = face->glyph->bitmap;
+
+                glyph.left = face->glyph->bitmap_left;
+                glyph.top = face->glyph->bitmap_top;
+                glyph.width = bitmap.width;
+                glyph.height = bitmap.rows;
+                glyph.pixels.resize(glyph.width * glyph.height);
+                for (int i = 0; i < glyph.height; i++) {
+                    memcpy(&glyph.pixels[i * glyph.width], bitmap.buffer + i * bitmap.pitch, glyph.width);
+                }
+                bitmaps.push_back(std::move(glyph));
+            }
+            TraceEvent(trace_font_loaded, weight, batch.size());
+        }
+
+        pthread_mutex_lock(&rasterizer_lock);
+        for (auto &glyph : bitmaps) {
+            results.push_back(std::move(glyph));
+        }
+        pthread_mutex_unlock(&rasterizer_lock);
+        batch_done();
+    }
+}
+
+void StartRasterizer(const char *font_dir, int pixel_size, void (*done)()) {
+    batch_done = done;
+
+    // without freetype or a font, glyphs of that weight are drawn blank
+    std::string fonts[NUM_WEIGHT] = {
+        std::string(font_dir) + "/Inconsolata-Regular.ttf",
+        std::string(font_dir) + "/Inconsolata-Bold.ttf",
+    };
+    if (FT_Init_FreeType(&ft) == 0) {
+        for (int weight = 0; weight < NUM_WEIGHT; weight++) {
+            if (FT_New_Face(ft, fonts[weight].c_str(), 0, &faces[weight]) != 0) {
+                faces[weight] = nullptr;
+            } else {
+                FT_Set_Pixel_Sizes(faces[weight], 0, pixel_size);
+            }
+        }
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, RasterizerWorker, NULL);
+    pthread_detach(thread);
+}
+
+void RasterizeGlyphs(const std::vector<uint32_t> &codepoints) {
+    if (codepoints.empty()) {
+        return;
+    }
+    pthread_mutex_lock(&rasterizer_lock);
+    requests.insert(requests.end(), codepoints.begin(), codepoints.end());
+    busy = true;
+    pthread_cond_signal(&request_cond);
+    pthread_mutex_unlock(&rasterizer_lock);
+}
+
+bool TakeGlyphs(std::vector<glyph_bitmap> &out, size_t max_glyphs) {
+    pthread_mutex_lock(&rasterizer_lock);
+    while (!results.empty() && max_glyphs > 0) {
+        out.push_back(std::move(results.front()));
+        results.pop_front();
+        max_glyphs--;
+    }
+    bool more = !results.empty();
+    pthread_mutex_unlock(&rasterizer_lock);
+    return more;
+}
+
+void WaitRasterizer() {
+    pthread_mutex_lock(&rasterizer_lock);
+    while (busy) {
+        pthread_cond_wait(&idle_cond, &rasterizer_lock);
+    }
+    pthread_mutex_unlock(&rasterizer_lock);
+}
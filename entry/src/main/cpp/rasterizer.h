@@ -0,0 +1,34 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "terminal.h"
+#include <cstdint>
+#include <vector>
+
+// glyph rasterization off the render thread
+// a worker thread keeps freetype and the faces of all weights open for the process lifetime and rasterizes
+// requested codepoints in small batches, so that the render thread only uploads finished bitmaps
+
+struct glyph_bitmap {
+    uint32_t codepoint;
+    enum weight weight;
+    // offset of the bitmap from the pen position, y goes up
+    int left;
+    int top;
+    int width;
+    int height;
+    // tightly packed rows, top row first
+    std::vector<uint8_t> pixels;
+};
+
+// open the fonts in font_dir at the pixel size and start the worker
+// done is called from the worker after each batch of bitmaps becomes available
+void StartRasterizer(const char *font_dir, int pixel_size, void (*done)());
+// queue codepoints to be rasterized in all weights
+void RasterizeGlyphs(const std::vector<uint32_t> &codepoints);
+// move up to max_glyphs finished bitmaps to out, returns true if more are left
+bool TakeGlyphs(std::vector<glyph_bitmap> &out, size_t max_glyphs);
+// block until all queued codepoints are rasterized
+void WaitRasterizer();
+
+#endif
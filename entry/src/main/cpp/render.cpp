@@ -0,0 +1,1171 @@
+#include "render.h"
+#include "history.h"
+#include "rasterizer.h"
+#include "terminal.h"
+#include "trace.h"
+#include <GLES3/gl32.h>
+#include <GLES2/gl2ext.h>
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include <set>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __OHOS__
+#include "hilog/log.h"
+#undef LOG_TAG
+#define LOG_TAG "testTag"
+#endif
+
+int font_height = 48;
+int font_width = 24;
+const char *font_dir = "/data/storage/el2/base/haps/entry/files";
+EGLDisplay egl_display;
+EGLContext egl_context;
+
+static GLint surface_location = -1;
+static GLint render_pass_location = -1;
+static GLint cell_size_location = -1;
+static GLint first_row_location = -1;
+static int baseline_height = 10;
+
+static void LogError(const char *what, const char *message) {
+#ifdef __OHOS__
+    OH_LOG_ERROR(LOG_APP, "%{public}s: %{public}s", what, message);
+#else
+    fprintf(stderr, "%s: %s\n", what, message);
+#endif
+}
+
+// https://learnopengl.com/In-Practice/Text-Rendering
+struct ivec2 {
+    int x;
+    int y;
+
+    ivec2(int x, int y) {
+        this->x = x;
+        this->y = y;
+    }
+    ivec2() { this->x = this->y = 0; }
+};
+
+struct character {
+    // location of the bitmap in the atlas in pixels, page is -1 if the glyph was evicted
+    int page;
+    int x;
+    int y;
+    // x, y offset from origin for bearing etc.
+    int xoff;
+    int yoff;
+    // glyph size
+    int width;
+    int height;
+};
+
+// maps (codepoint, weight) to an index into glyphs
+// latin-1 is looked up directly, the rest in an open addressing hash table with linear probing
+struct glyph_table {
+    static const uint32_t EMPTY_KEY = 0xffffffff;
+
+    int32_t direct[NUM_WEIGHT][256];
+    // key is codepoint * NUM_WEIGHT + weight, size is a power of two
+    std::vector<uint32_t> keys;
+    std::vector<int32_t> values;
+    size_t count = 0;
+
+    glyph_table() {
+        std::fill(&direct[0][0], &direct[0][0] + NUM_WEIGHT * 256, -1);
+        keys.assign(256, EMPTY_KEY);
+        values.assign(256, -1);
+    }
+
+    static uint32_t Hash(uint32_t key) {
+        uint32_t hash = key * 0x9e3779b1;
+        return hash ^ (hash >> 16);
+    }
+
+    // -1 if not loaded
+    int Find(uint32_t codepoint, enum weight weight) const {
+        if (codepoint < 256) {
+            return direct[weight][codepoint];
+        }
+        uint32_t key = codepoint * NUM_WEIGHT + weight;
+        size_t mask = keys.size() - 1;
+        for (size_t i = Hash(key) & mask;; i = (i + 1) & mask) {
+            if (keys[i] == key) {
+                return values[i];
+            } else if (keys[i] == EMPTY_KEY) {
+                return -1;
+            }
+        }
+    }
+
+    void Insert(uint32_t codepoint, enum weight weight, int index) {
+        if (codepoint < 256) {
+            direct[weight][codepoint] = index;
+            return;
+        }
+        // keep the load factor at most 1/2
+        if ((count + 1) * 2 > keys.size()) {
+            std::vector<uint32_t> old_keys(keys.size() * 2, EMPTY_KEY);
+            std::vector<int32_t> old_values(values.size() * 2, -1);
+            old_keys.swap(keys);
+            old_values.swap(values);
+            count = 0;
+            for (size_t i = 0; i < old_keys.size(); i++) {
+                if (old_keys[i] != EMPTY_KEY) {
+                    Insert(old_keys[i] / NUM_WEIGHT, (enum weight)(old_keys[i] % NUM_WEIGHT), old_values[i]);
+                }
+            }
+        }
+        uint32_t key = codepoint * NUM_WEIGHT + weight;
+        size_t mask = keys.size() - 1;
+        size_t i = Hash(key) & mask;
+        while (keys[i] != EMPTY_KEY && keys[i] != key) {
+            i = (i + 1) & mask;
+        }
+        if (keys[i] == EMPTY_KEY) {
+            count++;
+        }
+        keys[i] = key;
+        values[i] = index;
+    }
+};
+
+// per-cell instance data, expanded into a background quad and a glyph quad by the vertex shader
+struct cell_instance {
+    // position in cells, row is the line number modulo 65536 and counts from the first line on screen in the shader
+    // so that instances stay valid while lines move on screen
+    uint16_t col;
+    uint16_t row;
+    uint32_t glyph;
+    // rgba8
+    uint32_t fg;
+    uint32_t bg;
+};
+
+// record info for each loaded glyph, indices are stable across loads and evictions
+// the same indices are used in the glyph info texture
+static std::vector<character> glyphs;
+static glyph_table glyph_indices;
+
+// instances of one line, built when the line or its glyphs change rather than every frame
+struct line_cache {
+    // line number as in history.pushed, and for terminal rows the row generation it was built from
+    uint64_t line = UINT64_MAX;
+    uint64_t generation = 0;
+    // glyph_epoch when built
+    uint64_t epoch = 0;
+    // some glyphs are drawn as placeholder until they are uploaded
+    bool missing = false;
+    // bit mask of the atlas pages used
+    uint32_t pages = 0;
+    // sorted by col, blank cells are left out
+    std::vector<cell_instance> instances;
+};
+
+// a session and the surface it is drawn to
+struct term_view {
+    term_session *session;
+    // protected by redraw_lock
+    EGLSurface surface = EGL_NO_SURFACE;
+    int width = 0;
+    int height = 0;
+    // pixels scrolled back into history, 0 is the bottom
+    float scroll_offset = 0;
+    bool need_redraw = true;
+
+    // render worker only
+    // indexed like terminal.rows
+    std::vector<line_cache> screen_cache;
+    // history lines, indexed by line number modulo its power of two size
+    std::vector<line_cache> history_cache;
+    // history.layout the history lines were built for
+    uint64_t history_layout = 0;
+};
+
+// damage tracking: the render worker sleeps on redraw_cond until something visible changes
+// redraw_lock protects the views and need_redraw, it is only ever held briefly
+static pthread_mutex_t redraw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t redraw_cond = PTHREAD_COND_INITIALIZER;
+// views are never freed, a detached one keeps its caches for when its session is attached again
+static std::vector<term_view *> views;
+// surfaces of detached views, the render worker destroys them
+static std::vector<EGLSurface> dead_surfaces;
+// some view with a surface needs a redraw, or there are surfaces to destroy
+static bool need_redraw = false;
+
+// the view of session, created on first use, redraw_lock must be held
+static term_view *FindView(term_session *session) {
+    for (term_view *view : views) {
+        if (view->session == session) {
+            return view;
+        }
+    }
+    term_view *view = new term_view();
+    view->session = session;
+    views.push_back(view);
+    return view;
+}
+
+// redraw_lock must be held
+static void MarkRedraw(term_view *view) {
+    view->need_redraw = true;
+    if (view->surface != EGL_NO_SURFACE) {
+        need_redraw = true;
+        pthread_cond_signal(&redraw_cond);
+    }
+}
+
+// e.g. when glyphs arrive, which any view may be waiting for
+static void RequestRedrawAll() {
+    pthread_mutex_lock(&redraw_lock);
+    for (term_view *view : views) {
+        MarkRedraw(view);
+    }
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void AttachSurface(term_session *session, EGLSurface surface) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    if (view->surface != EGL_NO_SURFACE && view->surface != surface) {
+        dead_surfaces.push_back(view->surface);
+    }
+    view->surface = surface;
+    MarkRedraw(view);
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void DetachSurface(term_session *session) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    if (view->surface != EGL_NO_SURFACE) {
+        dead_surfaces.push_back(view->surface);
+        view->surface = EGL_NO_SURFACE;
+        need_redraw = true;
+        pthread_cond_signal(&redraw_cond);
+    }
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void RequestRedraw(term_session *session) {
+    pthread_mutex_lock(&redraw_lock);
+    MarkRedraw(FindView(session));
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void ScrollBy(term_session *session, float pixels) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    int old_rows = view->scroll_offset / font_height;
+    view->scroll_offset = std::max(view->scroll_offset + pixels, 0.0f);
+    // the upper bound depends on the history size, Draw clamps it
+    if ((int)(view->scroll_offset / font_height) != old_rows) {
+        MarkRedraw(view);
+    }
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void ScrollToBottom(term_session *session) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    if (view->scroll_offset != 0) {
+        view->scroll_offset = 0;
+        MarkRedraw(view);
+    }
+    pthread_mutex_unlock(&redraw_lock);
+}
+
+void SetSurfaceSize(term_session *session, int new_width, int new_height) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    view->width = new_width;
+    view->height = new_height;
+    MarkRedraw(view);
+    pthread_mutex_unlock(&redraw_lock);
+}
+// changes when glyphs are uploaded or evicted
+static uint64_t glyph_epoch = 1;
+// glyph_epoch of the last eviction, caches built before may refer to evicted glyphs
+static uint64_t evict_epoch = 0;
+// code points seen without a glyph, to be handed to the rasterizer
+static std::set<uint32_t> codepoints_to_load;
+// code points handed to the rasterizer, whose glyphs are loaded or on the way
+static std::set<uint32_t> codepoints_requested;
+// are there glyphs to load?
+static bool need_load_glyphs = false;
+// at most this many rasterized glyphs are uploaded per frame, so that frame times stay bounded
+#define UPLOAD_BATCH 256
+
+// glyph bitmaps live in an array texture of ATLAS_SIZE x ATLAS_SIZE pages, packed into shelves:
+// a shelf is a strip of a page as high as the tallest glyph it was opened for, filled left to right
+// new glyphs are rasterized and uploaded on their own. when all pages are full, the number of pages doubles
+// up to ATLAS_MAX_PAGES, after that the least recently drawn page is evicted and its glyphs are loaded again on demand
+#define ATLAS_SIZE 1024
+// 8 pages of 1 MB each, the page masks of rows allow up to 32
+#define ATLAS_MAX_PAGES 8
+static_assert(ATLAS_MAX_PAGES <= 32, "a set of atlas pages must fit in a uint32_t mask");
+// empty pixels around each glyph, so that linear filtering never picks up a neighbour
+#define ATLAS_PADDING 1
+struct atlas_shelf {
+    int page;
+    int y;
+    int height;
+    // next free x
+    int x;
+};
+static GLuint atlas_texture;
+static int atlas_pages = 0;
+static std::vector<atlas_shelf> atlas_shelves;
+// next free y for a new shelf, per page
+static std::vector<int> atlas_page_top;
+// frame in which each page was last drawn from
+static std::vector<uint64_t> atlas_page_used;
+static uint64_t frame_count = 0;
+
+// id of texture for glyph info, two rgba32f texels per glyph:
+// (x, y, page, 0) in the atlas and (xoff, yoff, width, height) in pixels
+static GLuint glyph_info_texture_id;
+#define GLYPH_INFO_WIDTH 1024
+// texture rows allocated for glyph info, and a copy of the texture contents
+static int glyph_info_height = 0;
+static std::vector<GLfloat> glyph_info;
+
+// zero pages [first, last) of the atlas
+static void ClearAtlasPages(int first, int last) {
+    std::vector<uint8_t> zero(ATLAS_SIZE * ATLAS_SIZE);
+    for (int page = first; page < last; page++) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, page, ATLAS_SIZE, ATLAS_SIZE, 1, GL_RED, GL_UNSIGNED_BYTE,
+                        zero.data());
+    }
+}
+
+// allocate an atlas with more pages, keeping the contents of the old one
+static void GrowAtlas(int pages) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R8, ATLAS_SIZE, ATLAS_SIZE, pages);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (atlas_pages > 0) {
+        // copied on the gpu, no glyph is rasterized again
+        glCopyImageSubData(atlas_texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                           ATLAS_SIZE, ATLAS_SIZE, atlas_pages);
+        glDeleteTextures(1, &atlas_texture);
+    }
+    ClearAtlasPages(atlas_pages, pages);
+    atlas_texture = texture;
+    atlas_pages = pages;
+    atlas_page_top.resize(pages, 0);
+    atlas_page_used.resize(pages, 0);
+    TraceEvent(trace_atlas_grow, pages, glyphs.size());
+}
+
+// forget all glyphs of the least recently drawn page and reuse it
+static int EvictAtlasPage() {
+    int page = std::min_element(atlas_page_used.begin(), atlas_page_used.end()) - atlas_page_used.begin();
+    int evicted = 0;
+    for (character &ch : glyphs) {
+        if (ch.page == page && ch.width > 0) {
+            ch.page = -1;
+            evicted++;
+        }
+    }
+    // evicted glyphs are requested from the rasterizer again when drawn
+    for (size_t i = 0; i < glyph_indices.keys.size(); i++) {
+        uint32_t key = glyph_indices.keys[i];
+        if (key != glyph_table::EMPTY_KEY && glyphs[glyph_indices.values[i]].page == -1) {
+            codepoints_requested.erase(key / NUM_WEIGHT);
+        }
+    }
+    for (int weight = 0; weight < NUM_WEIGHT; weight++) {
+        for (uint32_t c = 0; c < 256; c++) {
+            int index = glyph_indices.direct[weight][c];
+            if (index != -1 && glyphs[index].page == -1) {
+                codepoints_requested.erase(c);
+            }
+        }
+    }
+    atlas_shelves.erase(std::remove_if(atlas_shelves.begin(), atlas_shelves.end(),
+                                       [page](const atlas_shelf &shelf) { return shelf.page == page; }),
+                        atlas_shelves.end());
+    atlas_page_top[page] = 0;
+    ClearAtlasPages(page, page + 1);
+    // lines may refer to the evicted glyphs
+    evict_epoch = ++glyph_epoch;
+    TraceEvent(trace_atlas_evict, page, evicted);
+    return page;
+}
+
+// find room for a width x height bitmap, atlas texture must be bound
+static void AllocateAtlas(int width, int height, int &page, int &x, int &y) {
+    width += ATLAS_PADDING * 2;
+    height += ATLAS_PADDING * 2;
+    assert(width <= ATLAS_SIZE && height <= ATLAS_SIZE);
+
+    // the lowest shelf that fits, so tall shelves are not wasted on small glyphs
+    atlas_shelf *best = nullptr;
+    for (atlas_shelf &shelf : atlas_shelves) {
+        if (shelf.height >= height && shelf.x + width <= ATLAS_SIZE && (!best || shelf.height < best->height)) {
+            best = &shelf;
+        }
+    }
+
+    if (!best) {
+        // open a new shelf, rounded up so that glyphs of similar height share it
+        int shelf_height = std::min((height + 7) & ~7, ATLAS_SIZE);
+        int shelf_page = -1;
+        for (int i = 0; i < atlas_pages; i++) {
+            if (atlas_page_top[i] + shelf_height <= ATLAS_SIZE) {
+                shelf_page = i;
+                break;
+            }
+        }
+        if (shelf_page == -1) {
+            if (atlas_pages < ATLAS_MAX_PAGES) {
+                shelf_page = atlas_pages;
+                GrowAtlas(std::min(atlas_pages * 2, ATLAS_MAX_PAGES));
+            } else {
+                shelf_page = EvictAtlasPage();
+            }
+        }
+        atlas_shelves.push_back({shelf_page, atlas_page_top[shelf_page], shelf_height, 0});
+        atlas_page_top[shelf_page] += shelf_height;
+        best = &atlas_shelves.back();
+    }
+
+    page = best->page;
+    x = best->x + ATLAS_PADDING;
+    y = best->y + ATLAS_PADDING;
+    best->x += width;
+    // drawn from in the next frame, keep it from being evicted before that
+    atlas_page_used[page] = frame_count + 1;
+}
+
+// write the glyph info texels of glyphs [first, glyphs.size())
+static void UploadGlyphInfo(size_t first) {
+    glBindTexture(GL_TEXTURE_2D, glyph_info_texture_id);
+    int needed_height = (glyphs.size() * 2 + GLYPH_INFO_WIDTH - 1) / GLYPH_INFO_WIDTH;
+    if (needed_height > glyph_info_height) {
+        // reallocate with room to spare, and upload everything again
+        glyph_info_height = needed_height * 2;
+        glyph_info.resize(glyph_info_height * GLYPH_INFO_WIDTH * 4);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, GLYPH_INFO_WIDTH, glyph_info_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+        // float textures are not filterable, read with texelFetch
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        first = 0;
+    }
+    if (first < glyphs.size()) {
+        for (size_t index = first; index < glyphs.size(); index++) {
+            const character &ch = glyphs[index];
+            GLfloat info[8] = {(GLfloat)ch.x,    (GLfloat)ch.y,    (GLfloat)ch.page,  0.0f,
+                               (GLfloat)ch.xoff, (GLfloat)ch.yoff, (GLfloat)ch.width, (GLfloat)ch.height};
+            std::copy(&info[0], &info[8], &glyph_info[index * 8]);
+        }
+        // whole texture rows covering the changed glyphs
+        int first_row = first * 2 / GLYPH_INFO_WIDTH;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first_row, GLYPH_INFO_WIDTH, needed_height - first_row, GL_RGBA, GL_FLOAT,
+                        &glyph_info[first_row * GLYPH_INFO_WIDTH * 4]);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// copy glyphs finished by the rasterizer into the atlas, returns true if there are more to upload
+// only the new glyphs are uploaded, the rest of the atlas stays as is
+static bool UploadGlyphs(size_t max_glyphs) {
+    static std::vector<glyph_bitmap> bitmaps;
+    bitmaps.clear();
+    bool more = TakeGlyphs(bitmaps, max_glyphs);
+    if (bitmaps.empty()) {
+        return more;
+    }
+
+    // glyphs from here on get their info uploaded, as well as glyphs loaded again after eviction
+    size_t first_changed = glyphs.size();
+    // bitmap rows are tightly packed
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    for (const glyph_bitmap &bitmap : bitmaps) {
+        int index = glyph_indices.Find(bitmap.codepoint, bitmap.weight);
+        if (index != -1 && glyphs[index].page != -1) {
+            // the other weight was evicted, this one is still there
+            continue;
+        }
+
+        character character = {
+            .page = 0,
+            .x = 0,
+            .y = 0,
+            .xoff = bitmap.left,
+            .yoff = baseline_height + bitmap.top - bitmap.height,
+            .width = bitmap.width,
+            .height = bitmap.height,
+        };
+        // blank glyphs like space take no room in the atlas
+        if (bitmap.width > 0 && bitmap.height > 0) {
+            // may reallocate or evict, so bind afterwards
+            AllocateAtlas(bitmap.width, bitmap.height, character.page, character.x, character.y);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, atlas_texture);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, character.x, character.y, character.page, bitmap.width,
+                            bitmap.height, 1, GL_RED, GL_UNSIGNED_BYTE, bitmap.pixels.data());
+        }
+
+        if (index == -1) {
+            glyph_indices.Insert(bitmap.codepoint, bitmap.weight, glyphs.size());
+            glyphs.push_back(character);
+        } else {
+            glyphs[index] = character;
+            first_changed = std::min(first_changed, (size_t)index);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    UploadGlyphInfo(first_changed);
+
+    // lines with placeholders are built again
+    glyph_epoch++;
+    return more;
+}
+
+// called on the rasterizer thread when glyphs are ready for upload
+static void GlyphsRasterized() { RequestRedrawAll(); }
+
+static GLuint vertex_array;
+static GLint cell_location = -1;
+static GLint glyph_location = -1;
+static GLint text_color_location = -1;
+static GLint background_color_location = -1;
+
+// cell_instance arrays are streamed through a ring of STREAM_FRAMES regions in one buffer, so the cpu fills the region
+// of the next frame while the gpu may still read from the previous ones. a fence per region tells when it is free.
+#define STREAM_FRAMES 3
+static GLuint instance_buffer;
+// bytes per region
+static size_t stream_region_size = 0;
+static int stream_region = 0;
+static GLsync stream_fences[STREAM_FRAMES];
+// with GL_EXT_buffer_storage the buffer stays mapped, otherwise each region is mapped unsynchronized per frame
+static PFNGLBUFFERSTORAGEEXTPROC buffer_storage = nullptr;
+static uint8_t *stream_mapping = nullptr;
+
+// create the ring with room for region_size bytes per frame
+static void AllocateStream(size_t region_size) {
+    for (auto &fence : stream_fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+    // the old storage lives on until the gpu is done with it
+    if (instance_buffer) {
+        glDeleteBuffers(1, &instance_buffer);
+    }
+
+    glGenBuffers(1, &instance_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    stream_region_size = region_size;
+    stream_region = 0;
+    if (buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT_EXT | GL_MAP_COHERENT_BIT_EXT;
+        buffer_storage(GL_ARRAY_BUFFER, region_size * STREAM_FRAMES, nullptr, flags);
+        stream_mapping = (uint8_t *)glMapBufferRange(GL_ARRAY_BUFFER, 0, region_size * STREAM_FRAMES, flags);
+        assert(stream_mapping);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, region_size * STREAM_FRAMES, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+// point the per-instance attributes at a cell_instance array at offset in instance_buffer
+static void SetInstanceAttributes(size_t offset) {
+    glVertexAttribIPointer(cell_location, 2, GL_UNSIGNED_SHORT, sizeof(cell_instance),
+                           (void *)(offset + offsetof(cell_instance, col)));
+    glVertexAttribIPointer(glyph_location, 1, GL_UNSIGNED_INT, sizeof(cell_instance),
+                           (void *)(offset + offsetof(cell_instance, glyph)));
+    glVertexAttribPointer(text_color_location, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(cell_instance),
+                          (void *)(offset + offsetof(cell_instance, fg)));
+    glVertexAttribPointer(background_color_location, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(cell_instance),
+                          (void *)(offset + offsetof(cell_instance, bg)));
+}
+
+// concatenate the instances of lines, with the cursor cell of cursor_line replaced by cursor
+// returns the number of instances written
+static size_t CopyInstances(cell_instance *out, const std::vector<const line_cache *> &lines,
+                          const line_cache *cursor_line, const cell_instance &cursor) {
+    bool cursor_placed = !cursor_line;
+    cell_instance *begin = out;
+    for (const line_cache *line : lines) {
+        size_t count = line->instances.size();
+        memcpy(out, line->instances.data(), sizeof(cell_instance) * count);
+        if (line == cursor_line) {
+            cell_instance *it = std::lower_bound(
+                out, out + count, cursor.col, [](const cell_instance &a, uint16_t col) { return a.col < col; });
+            if (it != out + count && it->col == cursor.col) {
+                *it = cursor;
+                cursor_placed = true;
+            }
+        }
+        out += count;
+    }
+    // a blank cell is not in the line, draw it on top
+    if (!cursor_placed) {
+        *out++ = cursor;
+    }
+    return out - begin;
+}
+
+// copy instances to the next free region of the ring, vertex array must be bound
+// returns the number of instances
+static size_t StreamInstances(const std::vector<const line_cache *> &lines, const line_cache *cursor_line,
+                              const cell_instance &cursor) {
+    // one more for a cursor on a blank cell
+    size_t count = cursor_line ? 1 : 0;
+    for (const line_cache *line : lines) {
+        count += line->instances.size();
+    }
+    size_t size = sizeof(cell_instance) * count;
+    if (size > stream_region_size) {
+        // first frame or a larger surface, leave some headroom
+        AllocateStream(std::max(size * 2, (size_t)64 * 1024));
+    }
+
+    GLsync &fence = stream_fences[stream_region];
+    if (fence) {
+        // only blocks if the gpu is STREAM_FRAMES frames behind
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    size_t offset = stream_region * stream_region_size;
+    size_t written = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    if (stream_mapping) {
+        written = CopyInstances((cell_instance *)(stream_mapping + offset), lines, cursor_line, cursor);
+    } else if (size > 0) {
+        // the fence already guarantees the gpu is done with this range
+        void *data = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+                                      GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        assert(data);
+        written = CopyInstances((cell_instance *)data, lines, cursor_line, cursor);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    SetInstanceAttributes(offset);
+    return written;
+}
+
+// the region can be reused once the gpu has executed the draws of this frame
+static void FenceInstances() {
+    stream_fences[stream_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream_region = (stream_region + 1) % STREAM_FRAMES;
+}
+
+static uint32_t PackColor(const float *rgb) {
+    return (uint32_t)(rgb[0] * 255.0f + 0.5f) | (uint32_t)(rgb[1] * 255.0f + 0.5f) << 8 |
+           (uint32_t)(rgb[2] * 255.0f + 0.5f) << 16 | 0xff000000;
+}
+
+// index of the glyph to draw, missing or evicted glyphs are queued for loading and drawn as space until then
+// adds the atlas page of the glyph to pages, and sets missing if the placeholder is used
+static uint32_t ResolveGlyph(uint32_t codepoint, enum weight weight, uint32_t &pages, bool &missing) {
+    int index = glyph_indices.Find(codepoint, weight);
+    if (index == -1 || glyphs[index].page == -1) {
+        TraceEvent(trace_missing_glyph, codepoint, weight);
+        need_load_glyphs = true;
+        missing = true;
+        codepoints_to_load.insert(codepoint);
+        // space takes no room in the atlas, so it is never evicted
+        index = glyph_indices.Find(' ', weight);
+        assert(index != -1);
+    }
+    pages |= 1u << glyphs[index].page;
+    return index;
+}
+
+static cell_instance MakeInstance(const term_session *session, const term_char &c, int col, uint64_t line,
+                                  bool inverted, uint32_t &pages, bool &missing) {
+    // resolve color indices to rgb
+    const float *fg = session->Color(c.style.fg);
+    const float *bg = session->Color(c.style.bg);
+    cell_instance instance;
+    instance.col = col;
+    instance.row = line;
+    instance.glyph = ResolveGlyph(c.ch, c.style.Weight(), pages, missing);
+    if (inverted) {
+        float inverted_fg[3] = {1.0f - fg[0], 1.0f - fg[1], 1.0f - fg[2]};
+        float inverted_bg[3] = {1.0f - bg[0], 1.0f - bg[1], 1.0f - bg[2]};
+        instance.fg = PackColor(inverted_fg);
+        instance.bg = PackColor(inverted_bg);
+    } else {
+        instance.fg = PackColor(fg);
+        instance.bg = PackColor(bg);
+    }
+    return instance;
+}
+
+static bool LineCacheValid(const line_cache &cache, uint64_t line, uint64_t generation) {
+    return cache.line == line && cache.generation == generation && cache.epoch >= evict_epoch &&
+           (!cache.missing || cache.epoch == glyph_epoch);
+}
+
+static void BuildLine(const term_session *session, const std::vector<term_char> &cells, uint64_t line,
+                      uint64_t generation, line_cache &cache) {
+    cache.line = line;
+    cache.generation = generation;
+    cache.epoch = glyph_epoch;
+    cache.missing = false;
+    cache.pages = 0;
+    cache.instances.clear();
+    for (int col = 0; col < (int)cells.size(); col++) {
+        const term_char &c = cells[col];
+        if (c.ch == ' ' && c.style.bg == color_default_bg) {
+            // nothing to draw over the cleared background
+            continue;
+        }
+        cache.instances.push_back(MakeInstance(session, c, col, line, false, cache.pages, cache.missing));
+    }
+}
+
+// history rows rewrapped per history lock when scrolled back after a width change
+#define REWRAP_STEP 4096
+
+static void DrawView(term_view *view) {
+    // rasterized glyphs are uploaded before the frame uses them, if there are too many the rest go in the next frame
+    if (UploadGlyphs(UPLOAD_BATCH)) {
+        RequestRedrawAll();
+    }
+
+    // everything requested up to now is in this frame, including the snapshot taken below
+    pthread_mutex_lock(&redraw_lock);
+    view->need_redraw = false;
+    EGLSurface surface = view->surface;
+    term_session *session = view->session;
+    const term_snapshot &snapshot = session->AcquireSnapshot();
+    int surface_width = view->width;
+    int surface_height = view->height;
+    int max_lines = surface_height / font_height;
+    int scroll_rows = view->scroll_offset / font_height;
+    pthread_mutex_unlock(&redraw_lock);
+
+    // the rows scrolled to are counted exactly, so the scroll range ends where history does
+    // they are rewrapped outside redraw_lock and a few at a time, so neither the ui thread nor the parser wait long
+    int history_rows;
+    while ((history_rows = session->history->RowsBefore(snapshot.history_pushed, scroll_rows, REWRAP_STEP)) == -1) {
+    }
+    // ensure at least one line shown, for very large scroll_offset
+    if (history_rows + max_lines - 1 - scroll_rows < 0) {
+        pthread_mutex_lock(&redraw_lock);
+        view->scroll_offset = std::min(view->scroll_offset, (float)(history_rows + max_lines - 1) * font_height);
+        scroll_rows = view->scroll_offset / font_height;
+        pthread_mutex_unlock(&redraw_lock);
+    }
+    if (surface == EGL_NO_SURFACE) {
+        return;
+    }
+    if (eglGetCurrentSurface(EGL_DRAW) != surface) {
+        eglMakeCurrent(egl_display, surface, surface, egl_context);
+    }
+    std::vector<line_cache> &screen_cache = view->screen_cache;
+    std::vector<line_cache> &history_cache = view->history_cache;
+
+    // clear buffer, cells in the default background color are not drawn
+    const float *default_bg = color_table[color_default_bg];
+    glClearColor(default_bg[0], default_bg[1], default_bg[2], 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // update surface size
+    glUniform2f(surface_location, surface_width, surface_height);
+    glUniform2f(cell_size_location, font_width, font_height);
+    glViewport(0, 0, surface_width, surface_height);
+
+    // set textures
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, atlas_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, glyph_info_texture_id);
+
+    // bind our vertex array
+    glBindVertexArray(vertex_array);
+
+    // line numbers: row i_row of the snapshot is line history_pushed + i_row, and history lines count down from there
+    // so lines keep their numbers, and cached instances stay valid, while scrolling in either direction
+    uint64_t first_line = snapshot.history_pushed - scroll_rows;
+    glUniform1ui(first_row_location, (uint16_t)first_line);
+
+    if (screen_cache.size() != snapshot.rows.size()) {
+        screen_cache.assign(snapshot.rows.size(), line_cache());
+    }
+    size_t history_slots = 1;
+    while (history_slots < (size_t)max_lines * 2) {
+        history_slots *= 2;
+    }
+    if (history_cache.size() != history_slots || view->history_layout != snapshot.history_layout) {
+        // history rows are numbered anew when rewrapped to another width
+        history_cache.assign(history_slots, line_cache());
+        view->history_layout = snapshot.history_layout;
+    }
+
+    // lines on screen from the top, only changed lines are built again
+    static std::vector<const line_cache *> lines;
+    lines.clear();
+    // atlas pages drawn from in this frame
+    uint32_t pages = 0;
+    std::vector<term_char> history_line;
+    const line_cache *cursor_line = nullptr;
+    for (int i = 0; i < max_lines; i++) {
+        // line 0 is at the top of the surface, it is the top row of the snapshot when scroll_offset is zero
+        int i_row = i - scroll_rows;
+        uint64_t line = first_line + i;
+        line_cache *cache;
+        if (i_row >= 0 && i_row < snapshot.size()) {
+            int ring_index = snapshot.RingIndex(i_row);
+            cache = &screen_cache[ring_index];
+            if (!LineCacheValid(*cache, line, snapshot.generation[ring_index])) {
+                BuildLine(session, snapshot.rows[ring_index], line, snapshot.generation[ring_index], *cache);
+            }
+            if (i_row == snapshot.row && snapshot.show_cursor) {
+                cursor_line = cache;
+            }
+        } else if (i_row < 0 && history_rows + i_row >= 0) {
+            // history lines only change with the layout, otherwise only their numbers are checked
+            cache = &history_cache[line & (history_slots - 1)];
+            if (!LineCacheValid(*cache, line, 0)) {
+                // dropped since the snapshot was taken, draw it blank
+                if (!session->history->GetLine(line, history_line)) {
+                    history_line.clear();
+                }
+                BuildLine(session, history_line, line, 0, *cache);
+            }
+        } else {
+            continue;
+        }
+        lines.push_back(cache);
+        pages |= cache->pages;
+    }
+
+    cell_instance cursor = {};
+    if (cursor_line) {
+        bool missing = false;
+        const std::vector<term_char> &cursor_row = snapshot.rows[snapshot.RingIndex(snapshot.row)];
+        cursor = MakeInstance(session, cursor_row[snapshot.col], snapshot.col, snapshot.history_pushed + snapshot.row,
+                              true, pages, missing);
+    }
+
+    frame_count++;
+    for (int page = 0; page < atlas_pages; page++) {
+        if (pages & (1u << page)) {
+            atlas_page_used[page] = frame_count;
+        }
+    }
+
+    size_t num_instances = StreamInstances(lines, cursor_line, cursor);
+
+    // draw in two pass, each instance is a quad of 4 vertices
+    // first pass: background
+    glUniform1i(render_pass_location, 0);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_instances);
+
+    // second pass: text
+    glUniform1i(render_pass_location, 1);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_instances);
+    FenceInstances();
+
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    // no glFinish, the swap flushes and the fences above pace the cpu
+    eglSwapBuffers(egl_display, surface);
+}
+
+void Draw(term_session *session) {
+    pthread_mutex_lock(&redraw_lock);
+    term_view *view = FindView(session);
+    pthread_mutex_unlock(&redraw_lock);
+    DrawView(view);
+}
+
+void InitRenderer() {
+    // build vertex and fragment shader
+    GLuint vertex_shader_id = glCreateShader(GL_VERTEX_SHADER);
+    // each instance is a cell, gl_VertexID selects the corner of its quad
+    // pass 0 covers the cell, pass 1 covers the glyph bitmap
+    char const *vertex_source = "#version 320 es\n"
+                                "\n"
+                                "in uvec2 cell;\n"
+                                "in uint glyph;\n"
+                                "in vec4 textColor;\n"
+                                "in vec4 backgroundColor;\n"
+                                "out vec3 texCoords;\n"
+                                "out vec3 fragTextColor;\n"
+                                "out vec3 fragBackgroundColor;\n"
+                                "uniform vec2 surface;\n"
+                                "uniform vec2 cellSize;\n"
+                                "// line number of the top row, modulo 65536 like cell.y\n"
+                                "uniform uint firstRow;\n"
+                                "uniform mediump int renderPass;\n"
+                                "uniform highp sampler2D glyphInfo;\n"
+                                "void main() {\n"
+                                "  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+                                "  vec2 origin = vec2(cell.x, (cell.y - firstRow) & 0xffffu) * cellSize;\n"
+                                "  origin.y = surface.y - origin.y - cellSize.y;\n"
+                                "  vec2 pos;\n"
+                                "  if (renderPass == 0) {\n"
+                                "    pos = origin + corner * cellSize;\n"
+                                "    texCoords = vec3(0.0, 0.0, 0.0);\n"
+                                "  } else {\n"
+                                "    // GLYPH_INFO_WIDTH texels per row\n"
+                                "    int index = int(glyph) * 2;\n"
+                                "    vec4 atlas = texelFetch(glyphInfo, ivec2(index % 1024, index / 1024), 0);\n"
+                                "    vec4 rect = texelFetch(glyphInfo, ivec2(index % 1024 + 1, index / 1024), 0);\n"
+                                "    pos = origin + rect.xy + corner * rect.zw;\n"
+                                "    // bitmap rows go down, ATLAS_SIZE pixels per page\n"
+                                "    vec2 texel = atlas.xy + vec2(corner.x, 1.0 - corner.y) * rect.zw;\n"
+                                "    texCoords = vec3(texel / 1024.0, atlas.z);\n"
+                                "  }\n"
+                                "  gl_Position = vec4(pos / surface * 2.0f - 1.0f, 0.0, 1.0);\n"
+                                "  fragTextColor = textColor.rgb;\n"
+                                "  fragBackgroundColor = backgroundColor.rgb;\n"
+                                "}";
+    glShaderSource(vertex_shader_id, 1, &vertex_source, NULL);
+    glCompileShader(vertex_shader_id);
+
+    int info_log_length;
+    glGetShaderiv(vertex_shader_id, GL_INFO_LOG_LENGTH, &info_log_length);
+    if (info_log_length > 0) {
+        std::vector<char> vertex_shader_error_message(info_log_length + 1);
+        glGetShaderInfoLog(vertex_shader_id, info_log_length, NULL, &vertex_shader_error_message[0]);
+        LogError("Failed to build vertex shader", &vertex_shader_error_message[0]);
+    }
+
+    GLuint fragment_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
+    char const *fragment_source = "#version 320 es\n"
+                                  "\n"
+                                  "precision lowp float;\n"
+                                  "in vec3 texCoords;\n"
+                                  "in vec3 fragTextColor;\n"
+                                  "in vec3 fragBackgroundColor;\n"
+                                  "out vec4 color;\n"
+                                  "uniform mediump sampler2DArray text;\n"
+                                  "uniform int renderPass;\n"
+                                  "void main() {\n"
+                                  "  if (renderPass == 0) {\n"
+                                  "    color = vec4(fragBackgroundColor, 1.0);\n"
+                                  "  } else {\n"
+                                  "    float alpha = texture(text, texCoords).r;\n"
+                                  "    color = vec4(fragTextColor, 1.0) * alpha;\n"
+                                  "  }\n"
+                                  "}";
+    // blending is done by opengl (GL_ONE + GL_ONE_MINUS_SRC_ALPHA):
+    // final = src * 1 + dest * (1 - src.a)
+    // first pass: src = (fragBackgroundColor, 1.0), dest = (1.0, 1.0, 1.0, 1.0), final = (fragBackgroundColor, 1.0)
+    // second pass: src = (fragTextColor * alpha, alpha), dest = (fragBackgroundColor, 1.0), final = (fragTextColor *
+    // alpha + fragBackgroundColor * (1 - alpha), 1.0)
+    glShaderSource(fragment_shader_id, 1, &fragment_source, NULL);
+    glCompileShader(fragment_shader_id);
+
+    glGetShaderiv(fragment_shader_id, GL_INFO_LOG_LENGTH, &info_log_length);
+    if (info_log_length > 0) {
+        std::vector<char> fragment_shader_error_message(info_log_length + 1);
+        glGetShaderInfoLog(fragment_shader_id, info_log_length, NULL, &fragment_shader_error_message[0]);
+        LogError("Failed to build fragment shader", &fragment_shader_error_message[0]);
+    }
+
+    GLuint program_id = glCreateProgram();
+    glAttachShader(program_id, vertex_shader_id);
+    glAttachShader(program_id, fragment_shader_id);
+    glLinkProgram(program_id);
+
+    glGetProgramiv(program_id, GL_INFO_LOG_LENGTH, &info_log_length);
+    if (info_log_length > 0) {
+        std::vector<char> link_program_error_message(info_log_length + 1);
+        glGetProgramInfoLog(program_id, info_log_length, NULL, &link_program_error_message[0]);
+        LogError("Failed to link program", &link_program_error_message[0]);
+    }
+
+    surface_location = glGetUniformLocation(program_id, "surface");
+    assert(surface_location != -1);
+
+    render_pass_location = glGetUniformLocation(program_id, "renderPass");
+    assert(render_pass_location != -1);
+
+    cell_size_location = glGetUniformLocation(program_id, "cellSize");
+    assert(cell_size_location != -1);
+
+    first_row_location = glGetUniformLocation(program_id, "firstRow");
+    assert(first_row_location != -1);
+
+    glUseProgram(program_id);
+    // glyph bitmaps on texture unit 0, glyph info on texture unit 1
+    glUniform1i(glGetUniformLocation(program_id, "text"), 0);
+    glUniform1i(glGetUniformLocation(program_id, "glyphInfo"), 1);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    // load font from ttf for the initial characters
+    GrowAtlas(1);
+    glGenTextures(1, &glyph_info_texture_id);
+    StartRasterizer(font_dir, font_height, GlyphsRasterized);
+    // load common characters initially, and wait for them since space is the fallback for missing glyphs
+    std::vector<uint32_t> ascii;
+    for (uint32_t i = 0; i < 128; i++) {
+        ascii.push_back(i);
+        codepoints_requested.insert(i);
+    }
+    RasterizeGlyphs(ascii);
+    WaitRasterizer();
+    UploadGlyphs(SIZE_MAX);
+
+    // create buffers for drawing
+    glGenVertexArrays(1, &vertex_array);
+    glBindVertexArray(vertex_array);
+
+    // cell_instance, advanced once per instance
+    // pointers are set per frame by StreamInstances
+    cell_location = glGetAttribLocation(program_id, "cell");
+    glyph_location = glGetAttribLocation(program_id, "glyph");
+    text_color_location = glGetAttribLocation(program_id, "textColor");
+    background_color_location = glGetAttribLocation(program_id, "backgroundColor");
+    for (GLint location : {cell_location, glyph_location, text_color_location, background_color_location}) {
+        assert(location != -1);
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    // persistent mapping if supported, e.g. on mesa and most mobile drivers
+    GLint num_extensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+    for (int i = 0; i < num_extensions; i++) {
+        if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_EXT_buffer_storage") == 0) {
+            buffer_storage = (PFNGLBUFFERSTORAGEEXTPROC)eglGetProcAddress("glBufferStorageEXT");
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void LoadMissingGlyphs() {
+    if (!need_load_glyphs) {
+        return;
+    }
+    need_load_glyphs = false;
+    // glyphs are drawn as space until the rasterizer is done, which then requests a redraw
+    std::vector<uint32_t> codepoints;
+    for (uint32_t c : codepoints_to_load) {
+        if (codepoints_requested.insert(c).second) {
+            codepoints.push_back(c);
+        }
+    }
+    codepoints_to_load.clear();
+    RasterizeGlyphs(codepoints);
+}
+
+void *RenderWorker(void *) {
+    pthread_setname_np(pthread_self(), "render worker");
+
+    // the context is made current with any attached surface, then with the surface of each view it draws
+    pthread_mutex_lock(&redraw_lock);
+    EGLSurface first_surface = EGL_NO_SURFACE;
+    for (term_view *view : views) {
+        if (view->surface != EGL_NO_SURFACE) {
+            first_surface = view->surface;
+        }
+    }
+    pthread_mutex_unlock(&redraw_lock);
+    eglMakeCurrent(egl_display, first_surface, first_surface, egl_context);
+    InitRenderer();
+
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    uint64_t last_redraw_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    uint64_t last_fps_msec = last_redraw_msec;
+    int fps = 0;
+    // 8ms frame slots without a frame because nothing changed
+    uint64_t frames_skipped = 0;
+    std::vector<uint64_t> time;
+    std::vector<term_view *> dirty_views;
+    std::vector<EGLSurface> surfaces_to_destroy;
+    while (1) {
+        // sleep until something visible changes
+        pthread_mutex_lock(&redraw_lock);
+        while (!need_redraw) {
+            pthread_cond_wait(&redraw_cond, &redraw_lock);
+        }
+        pthread_mutex_unlock(&redraw_lock);
+
+        gettimeofday(&tv, nullptr);
+        uint64_t now_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+        // even if we call faster than system settings (60Hz/120Hz), it does not get faster
+        // 120 Hz, 8ms
+        uint64_t deadline = last_redraw_msec + 8;
+        if (now_msec < deadline) {
+            usleep((deadline - now_msec) * 1000);
+        } else {
+            frames_skipped += (now_msec - last_redraw_msec) / 8 - 1;
+        }
+
+        // views changed up to now, and surfaces detached up to now
+        pthread_mutex_lock(&redraw_lock);
+        need_redraw = false;
+        dirty_views.clear();
+        for (term_view *view : views) {
+            if (view->need_redraw && view->surface != EGL_NO_SURFACE) {
+                dirty_views.push_back(view);
+            }
+        }
+        surfaces_to_destroy.swap(dead_surfaces);
+        pthread_mutex_unlock(&redraw_lock);
+        for (EGLSurface surface : surfaces_to_destroy) {
+            // a current surface is only released once another one is made current
+            eglDestroySurface(egl_display, surface);
+        }
+        surfaces_to_destroy.clear();
+        if (dirty_views.empty()) {
+            continue;
+        }
+
+        // redraw, one frame per view
+        gettimeofday(&tv, nullptr);
+        now_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        last_redraw_msec = now_msec;
+        for (term_view *view : dirty_views) {
+            DrawView(view);
+        }
+
+        gettimeofday(&tv, nullptr);
+        uint64_t msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        time.push_back(msec - now_msec);
+
+        fps++;
+
+        // report fps
+        if (now_msec - last_fps_msec > 1000) {
+            last_fps_msec = now_msec;
+            uint64_t sum = 0;
+            for (auto t : time) {
+                sum += t;
+            }
+            TraceEvent(trace_frame_stats, fps, sum / fps);
+            TraceEvent(trace_frames_skipped, frames_skipped, 0);
+            fps = 0;
+            frames_skipped = 0;
+            time.clear();
+        }
+
+        LoadMissingGlyphs();
+    }
+}
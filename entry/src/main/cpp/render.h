@@ -0,0 +1,49 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <EGL/egl.h>
+#include <pthread.h>
+
+// opengl es renderer of the terminal, only needs egl, gles 3.2 and freetype
+// so it also runs headless on mesa for render_benchmark
+//
+// each session is drawn to its own surface, all with one context on the render worker,
+// so the shaders, the glyph atlas and the instance buffer are shared by all sessions
+
+struct term_session;
+
+// cell size in pixels
+extern int font_height;
+extern int font_width;
+// directory containing Inconsolata-Regular.ttf and Inconsolata-Bold.ttf
+extern const char *font_dir;
+
+// every surface is created with this display and a config compatible with the context
+extern EGLDisplay egl_display;
+extern EGLContext egl_context;
+
+// the functions below may be called from any thread, they never wait for a frame to finish
+
+// draw session to surface from now on, replacing the surface it was drawn to before
+void AttachSurface(term_session *session, EGLSurface surface);
+// stop drawing session, the render worker destroys its surface
+void DetachSurface(term_session *session);
+// wake up the render worker to draw session
+void RequestRedraw(term_session *session);
+// scroll back into history by pixels, or forward if negative, and redraw if another line is at the top
+void ScrollBy(term_session *session, float pixels);
+// scroll to the bottom, e.g. on input
+void ScrollToBottom(term_session *session);
+// change the surface size and redraw
+void SetSurfaceSize(term_session *session, int new_width, int new_height);
+
+// build shaders and buffers and load the initial glyphs, the egl context must be current
+void InitRenderer();
+// upload rasterized glyphs, then render and swap one frame of session, its surface must be current
+void Draw(term_session *session);
+// hand glyphs that were missing in the last frames to the rasterizer thread, which requests a redraw once they are ready
+void LoadMissingGlyphs();
+// render loop, sleeps until a redraw is requested, started once the first surface is attached
+void *RenderWorker(void *);
+
+#endif
@@ -0,0 +1,244 @@
+#include "rasterizer.h"
+#include "render.h"
+#include "terminal.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl32.h>
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// headless benchmark of the renderer, on mesa's software gl or any egl with gles 3.2
+// replays pty output in slices, one frame per slice, into an offscreen pbuffer surface
+//
+// usage: render_benchmark [-n frames] [-w width] [-h height] [-f font dir] [-o ppm file] [-s lines] [recording]
+//
+// if no recording is given, colored text is generated. -o writes the last frame for visual checks.
+// -s then scrolls back through that many lines of history, one line per frame, like flicking through scrollback.
+
+// surface size in pixels
+static int width = 1920;
+static int height = 1080;
+static EGLSurface egl_surface;
+static term_session session;
+
+static uint64_t NowNsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// sgr heavy text filling every row, like `ls --color` or a colored build log
+static void GenerateText(std::vector<uint8_t> &data, size_t size) {
+    char line[256];
+    for (int i = 0; data.size() < size; i++) {
+        int length = snprintf(line, sizeof(line),
+                              "\x1b[0m\x1b[01;34mdir_%d\x1b[0m  \x1b[01;32mrun_%d.sh\x1b[0m  "
+                              "\x1b[31;47mpkg_%d.tar\x1b[0m  \x1b[38;5;%dmlink_%d\x1b[0m  file_%d.txt  {}[]<>|~\r\n",
+                              i, i, i, 16 + i % 216, i, i);
+        data.insert(data.end(), line, line + length);
+    }
+}
+
+static bool ReadFile(const char *path, std::vector<uint8_t> &data) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    uint8_t buffer[65536];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool WritePpm(const char *path) {
+    std::vector<uint8_t> pixels(width * height * 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "P6 %d %d 255\n", width, height);
+    // gl rows are bottom up
+    for (int y = height - 1; y >= 0; y--) {
+        for (int x = 0; x < width; x++) {
+            fwrite(&pixels[(y * width + x) * 4], 1, 3, fp);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// offscreen context, prefer the surfaceless platform so that no display server is needed
+static bool CreateContext() {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    egl_display = EGL_NO_DISPLAY;
+    if (get_platform_display) {
+        egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (egl_display == EGL_NO_DISPLAY) {
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (eglInitialize(egl_display, nullptr, nullptr) != EGL_TRUE) {
+        return false;
+    }
+
+    const EGLint attrib[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+                             EGL_RED_SIZE,     8,               EGL_GREEN_SIZE,      8,
+                             EGL_BLUE_SIZE,    8,               EGL_ALPHA_SIZE,      8,
+                             EGL_NONE};
+    EGLint num_configs;
+    EGLConfig egl_config;
+    if (eglChooseConfig(egl_display, attrib, &egl_config, 1, &num_configs) != EGL_TRUE || num_configs < 1) {
+        return false;
+    }
+
+    const EGLint surface_attributes[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    egl_surface = eglCreatePbufferSurface(egl_display, egl_config, surface_attributes);
+    eglBindAPI(EGL_OPENGL_ES_API);
+    const EGLint context_attributes[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 2, EGL_NONE};
+    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attributes);
+    if (egl_surface == EGL_NO_SURFACE || egl_context == EGL_NO_CONTEXT) {
+        return false;
+    }
+    return eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context) == EGL_TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    int frames = 600;
+    const char *ppm_path = nullptr;
+    int scroll_lines = 0;
+    font_dir = FONT_DIR;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:h:f:o:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'f':
+            font_dir = optarg;
+            break;
+        case 'o':
+            ppm_path = optarg;
+            break;
+        case 's':
+            scroll_lines = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n frames] [-w width] [-h height] [-f font dir] [-o ppm file] [-s lines] [recording]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (frames < 1 || width < font_width || height < font_height) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    if (optind < argc) {
+        if (!ReadFile(argv[optind], data)) {
+            fprintf(stderr, "Failed to read %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        GenerateText(data, 4 * 1024 * 1024);
+    }
+
+    if (!CreateContext()) {
+        fprintf(stderr, "Failed to create egl context: 0x%x\n", eglGetError());
+        return 1;
+    }
+    printf("renderer: %s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+    // replies to the application go nowhere
+    session.fd = open("/dev/null", O_WRONLY);
+    assert(session.fd != -1);
+    session.term_col = width / font_width;
+    session.term_row = height / font_height;
+    session.ResizeTerminal();
+    session.PublishSnapshot();
+    AttachSurface(&session, egl_surface);
+    SetSurfaceSize(&session, width, height);
+    InitRenderer();
+
+    // cpu time spent in Draw, and wall time including the gpu catching up at the end
+    // the slowest frame shows hitches, e.g. from uploading glyphs on first display of non-ascii text
+    uint64_t draw_nsec = 0;
+    uint64_t max_draw_nsec = 0;
+    uint64_t begin = NowNsec();
+    size_t slice = (data.size() + frames - 1) / frames;
+    for (int i = 0; i < frames; i++) {
+        size_t off = std::min(data.size(), i * slice);
+        pthread_mutex_lock(&session.lock);
+        session.ParseOutput(data.data() + off, std::min(slice, data.size() - off));
+        session.PublishSnapshot();
+        pthread_mutex_unlock(&session.lock);
+        session.FlushWriteQueue();
+
+        uint64_t draw_begin = NowNsec();
+        Draw(&session);
+        uint64_t draw_end = NowNsec();
+        draw_nsec += draw_end - draw_begin;
+        max_draw_nsec = std::max(max_draw_nsec, draw_end - draw_begin);
+        LoadMissingGlyphs();
+    }
+    glFinish();
+    uint64_t elapsed = NowNsec() - begin;
+
+    printf("%d frames of %dx%d cells, %.3f ms/frame in Draw (max %.3f), %.3f ms/frame overall, %.1f fps\n", frames,
+           session.term_col, session.term_row, (double)draw_nsec / frames / 1e6, (double)max_draw_nsec / 1e6,
+           (double)elapsed / frames / 1e6, frames / ((double)elapsed / 1e9));
+
+    if (scroll_lines > 0) {
+        draw_nsec = 0;
+        max_draw_nsec = 0;
+        begin = NowNsec();
+        for (int i = 1; i <= scroll_lines; i++) {
+            ScrollBy(&session, font_height);
+
+            uint64_t draw_begin = NowNsec();
+            Draw(&session);
+            uint64_t draw_end = NowNsec();
+            draw_nsec += draw_end - draw_begin;
+            max_draw_nsec = std::max(max_draw_nsec, draw_end - draw_begin);
+            LoadMissingGlyphs();
+        }
+        glFinish();
+        elapsed = NowNsec() - begin;
+        printf("%d frames scrolling back, %.3f ms/frame in Draw (max %.3f), %.3f ms/frame overall\n", scroll_lines,
+               (double)draw_nsec / scroll_lines / 1e6, (double)max_draw_nsec / 1e6,
+               (double)elapsed / scroll_lines / 1e6);
+    }
+
+    if (ppm_path) {
+        // glyphs missing in the last frame are still on the way, draw once more with them
+        WaitRasterizer();
+        Draw(&session);
+    }
+    if (ppm_path && !WritePpm(ppm_path)) {
+        fprintf(stderr, "Failed to write %s\n", ppm_path);
+        return 1;
+    }
+
+    close(session.fd);
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "history.h"
+#include "terminal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// headless checks of resizing: output is replayed into a session, then the screen is resized and the rows of
+// history and screen are compared with the text wrapped at the new width
+// runs on plain linux, no napi, hilog or egl involved. exits with 1 if any check fails
+//
+// usage: resize_test
+
+static int failures = 0;
+
+static void Feed(term_session &session, const std::string &data) {
+    session.ParseOutput((const uint8_t *)data.data(), data.size());
+}
+
+static void Resize(term_session &session, int rows, int cols) {
+    session.term_row = rows;
+    session.term_col = cols;
+    session.ResizeTerminal();
+}
+
+static std::string Text(const std::vector<term_char> &cells) {
+    std::string text;
+    for (const term_char &c : cells) {
+        text += (char)c.ch;
+    }
+    while (!text.empty() && text.back() == ' ') {
+        text.pop_back();
+    }
+    return text;
+}
+
+// rows of history followed by rows of the screen, as drawn when scrolled all the way back
+static std::vector<std::string> Rows(term_session &session) {
+    std::vector<std::string> rows;
+    uint64_t pushed = session.history->pushed;
+    int history_rows = session.history->RowsBefore(pushed, INT_MAX);
+    std::vector<term_char> cells;
+    for (int i = history_rows; i > 0; i--) {
+        if (!session.history->GetLine(pushed - i, cells)) {
+            // counted, but not there
+            cells.clear();
+            rows.push_back("<missing>");
+            continue;
+        }
+        rows.push_back(Text(cells));
+    }
+    for (int i = 0; i < session.terminal.size(); i++) {
+        rows.push_back(Text(session.terminal.Row(i)));
+    }
+    return rows;
+}
+
+// lines wrapped at cols, with the rows below the last line blank as on a screen of num_rows
+static std::vector<std::string> Wrap(const std::vector<std::string> &lines, int cols, int num_rows) {
+    std::vector<std::string> rows;
+    for (const std::string &line : lines) {
+        size_t i = 0;
+        do {
+            std::string row = line.substr(i, cols);
+            while (!row.empty() && row.back() == ' ') {
+                row.pop_back();
+            }
+            rows.push_back(row);
+            i += cols;
+        } while (i < line.size());
+    }
+    // rows left blank on screen, when there is not enough text to fill it
+    while ((int)rows.size() < num_rows) {
+        rows.push_back("");
+    }
+    return rows;
+}
+
+static void Check(const char *name, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n", name);
+        failures++;
+    }
+}
+
+static void CheckRows(const char *name, term_session &session, const std::vector<std::string> &expected) {
+    std::vector<std::string> rows = Rows(session);
+    if (rows == expected) {
+        return;
+    }
+    fprintf(stderr, "FAIL %s\n", name);
+    for (size_t i = 0; i < std::max(rows.size(), expected.size()); i++) {
+        fprintf(stderr, "  %2zu %-30s | %s\n", i, i < rows.size() ? ("\"" + rows[i] + "\"").c_str() : "",
+                i < expected.size() ? ("\"" + expected[i] + "\"").c_str() : "");
+    }
+    failures++;
+}
+
+static void CheckCursor(const char *name, term_session &session, int row, int col) {
+    if (session.row != row || session.col != col) {
+        fprintf(stderr, "FAIL %s: cursor at %d,%d, expected %d,%d\n", name, session.row, session.col, row, col);
+        failures++;
+    }
+}
+
+// lengths are no multiple of the widths, as a row filled to the last column wraps right away into an empty one
+
+// a line wrapped from history into the screen, with a short line and a prompt below
+static void TestNarrowing() {
+    term_session session;
+    Resize(session, 4, 10);
+    std::string long_line = "0123456789abcdefghijABCDEFGHIJklm";
+    std::vector<std::string> lines = {"one", long_line, "tiny", "$ "};
+    Feed(session, "one\r\n" + long_line + "\r\ntiny\r\n$ ");
+    CheckRows("narrowing, before", session, Wrap(lines, 10, 4));
+
+    Resize(session, 4, 5);
+    CheckRows("narrowing to 5 columns", session, Wrap(lines, 5, 4));
+    CheckCursor("narrowing to 5 columns", session, 3, 2);
+    // the screen is filled up with the end of the long line
+    Check("narrowing fills the screen", Text(session.terminal.Row(0)) == "FGHIJ" && Text(session.terminal.Row(1)) == "klm");
+
+    Resize(session, 4, 3);
+    CheckRows("narrowing to 3 columns", session, Wrap(lines, 3, 4));
+    CheckCursor("narrowing to 3 columns", session, 3, 2);
+}
+
+// rows freed by widening are filled from history
+static void TestWidening() {
+    term_session session;
+    Resize(session, 4, 5);
+    std::string long_line = "0123456789abcdefghijABCDEFGHIJklm";
+    std::vector<std::string> lines = {"one", long_line, "tiny", "$ "};
+    Feed(session, "one\r\n" + long_line + "\r\ntiny\r\n$ ");
+    CheckRows("widening, before", session, Wrap(lines, 5, 4));
+
+    Resize(session, 4, 20);
+    CheckRows("widening to 20 columns", session, Wrap(lines, 20, 4));
+    CheckCursor("widening to 20 columns", session, 3, 2);
+    Check("widening leaves one row in history", session.history->RowsBefore(session.history->pushed, INT_MAX) == 1);
+
+    // all of it fits, the text starts at the top
+    Resize(session, 8, 40);
+    CheckRows("widening to 40 columns and 8 rows", session, Wrap(lines, 40, 8));
+    CheckCursor("widening to 40 columns and 8 rows", session, 3, 2);
+    Check("widening empties history", session.history->RowsBefore(session.history->pushed, INT_MAX) == 0);
+
+    // and back
+    Resize(session, 4, 5);
+    CheckRows("narrowing back to 5 columns", session, Wrap(lines, 5, 4));
+    CheckCursor("narrowing back to 5 columns", session, 3, 2);
+}
+
+// only the number of rows changes
+static void TestRows() {
+    term_session session;
+    Resize(session, 6, 10);
+    std::vector<std::string> lines;
+    std::string data;
+    for (int i = 0; i < 10; i++) {
+        lines.push_back("line " + std::to_string(i));
+        data += lines.back() + "\r\n";
+    }
+    lines.push_back("$ ");
+    Feed(session, data + "$ ");
+
+    Resize(session, 3, 10);
+    CheckRows("fewer rows", session, Wrap(lines, 10, 3));
+    CheckCursor("fewer rows", session, 2, 2);
+
+    Resize(session, 9, 10);
+    CheckRows("more rows", session, Wrap(lines, 10, 9));
+    CheckCursor("more rows", session, 8, 2);
+    Check("more rows are filled from history", Text(session.terminal.Row(0)) == "line 2");
+}
+
+// the cursor in the middle of a command line that wraps, with text after it
+static void TestCursor() {
+    term_session session;
+    Resize(session, 5, 10);
+    std::string command = "$ echo 0123456789abcdefghij";
+    std::vector<std::string> lines = {"output", command};
+    Feed(session, "output\r\n" + command);
+    // back to the 'f'
+    Feed(session, "\x1b[5D");
+    CheckCursor("cursor, before", session, 3, 2);
+
+    Resize(session, 5, 7);
+    CheckRows("cursor, narrowing", session, Wrap(lines, 7, 5));
+    // the 'f' is cell 22 of the command line
+    CheckCursor("cursor, narrowing", session, 1 + 22 / 7, 22 % 7);
+
+    Resize(session, 5, 30);
+    CheckRows("cursor, widening", session, Wrap(lines, 30, 5));
+    CheckCursor("cursor, widening", session, 1, 22);
+}
+
+int main() {
+    TestNarrowing();
+    TestWidening();
+    TestRows();
+    TestCursor();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
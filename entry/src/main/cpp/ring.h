@@ -0,0 +1,71 @@
+#ifndef RING_H
+#define RING_H
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stddef.h>
+
+// lock-free single-producer single-consumer byte ring
+// the producer reads straight into WriteSpan and commits, the consumer parses straight from ReadSpan and consumes,
+// so bytes are never copied on the way. positions grow forever and are masked into the power of two capacity.
+// each side keeps a stale copy of the other side's position and only reloads it when the ring looks full or empty,
+// so the shared cache lines are touched once per batch rather than once per call.
+struct byte_ring {
+    // capacity must be a power of two
+    explicit byte_ring(size_t capacity) : data(new uint8_t[capacity]), capacity(capacity) {
+        assert((capacity & (capacity - 1)) == 0);
+    }
+
+    // producer only
+    // contiguous free space at the write position, up to the end of the buffer
+    uint8_t *WriteSpan(size_t *length) {
+        uint64_t head = write_pos.load(std::memory_order_relaxed);
+        if (head - cached_read_pos == capacity) {
+            cached_read_pos = read_pos.load(std::memory_order_acquire);
+        }
+        size_t offset = head & (capacity - 1);
+        *length = std::min(capacity - (size_t)(head - cached_read_pos), capacity - offset);
+        return data.get() + offset;
+    }
+    void Commit(size_t length) {
+        write_pos.store(write_pos.load(std::memory_order_relaxed) + length, std::memory_order_release);
+    }
+
+    // consumer only
+    // contiguous bytes at the read position, up to the end of the buffer
+    const uint8_t *ReadSpan(size_t *length) {
+        uint64_t tail = read_pos.load(std::memory_order_relaxed);
+        if (cached_write_pos == tail) {
+            cached_write_pos = write_pos.load(std::memory_order_acquire);
+        }
+        size_t offset = tail & (capacity - 1);
+        *length = std::min((size_t)(cached_write_pos - tail), capacity - offset);
+        return data.get() + offset;
+    }
+    void Consume(size_t length) {
+        read_pos.store(read_pos.load(std::memory_order_relaxed) + length, std::memory_order_release);
+    }
+
+    // bytes waiting, either side may move on right after
+    size_t Size() const {
+        // read_pos first, it never passes write_pos
+        uint64_t tail = read_pos.load(std::memory_order_acquire);
+        return write_pos.load(std::memory_order_acquire) - tail;
+    }
+    size_t Capacity() const { return capacity; }
+
+  private:
+    std::unique_ptr<uint8_t[]> data;
+    size_t capacity;
+
+    // on separate cache lines, so that the producer and the consumer do not invalidate each other's
+    alignas(64) std::atomic<uint64_t> write_pos{0};
+    uint64_t cached_read_pos = 0;
+    alignas(64) std::atomic<uint64_t> read_pos{0};
+    uint64_t cached_write_pos = 0;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include "history.h"
+#include "terminal.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// headless checks of scroll regions: DECSTBM, and line feeds, IL, DL, SU, SD and RI inside and outside the region
+// runs on plain linux, no napi, hilog or egl involved. exits with 1 if any check fails
+//
+// usage: scroll_region_test
+
+static int failures = 0;
+
+static void Feed(term_session &session, const std::string &data) {
+    session.ParseOutput((const uint8_t *)data.data(), data.size());
+}
+
+static void Resize(term_session &session, int rows, int cols) {
+    session.term_row = rows;
+    session.term_col = cols;
+    session.ResizeTerminal();
+}
+
+static std::string Text(const std::vector<term_char> &cells) {
+    std::string text;
+    for (const term_char &c : cells) {
+        text += (char)c.ch;
+    }
+    while (!text.empty() && text.back() == ' ') {
+        text.pop_back();
+    }
+    return text;
+}
+
+static void Check(const char *name, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n", name);
+        failures++;
+    }
+}
+
+static void CheckScreen(const char *name, term_session &session, const std::vector<std::string> &expected) {
+    std::vector<std::string> rows;
+    for (int i = 0; i < session.terminal.size(); i++) {
+        rows.push_back(Text(session.terminal.Row(i)));
+    }
+    if (rows == expected) {
+        return;
+    }
+    fprintf(stderr, "FAIL %s\n", name);
+    for (size_t i = 0; i < std::max(rows.size(), expected.size()); i++) {
+        fprintf(stderr, "  %2zu %-12s | %s\n", i, i < rows.size() ? ("\"" + rows[i] + "\"").c_str() : "",
+                i < expected.size() ? ("\"" + expected[i] + "\"").c_str() : "");
+    }
+    failures++;
+}
+
+static void CheckCursor(const char *name, term_session &session, int row, int col) {
+    if (session.row != row || session.col != col) {
+        fprintf(stderr, "FAIL %s: cursor at %d,%d, expected %d,%d\n", name, session.row, session.col, row, col);
+        failures++;
+    }
+}
+
+// a 6 row screen with its row number on each row, and rows 2 to 5 as the scroll region, 1 and 4 counted from 0
+static void Setup(term_session &session) {
+    Resize(session, 6, 10);
+    Feed(session, "0\r\n1\r\n2\r\n3\r\n4\r\n5");
+    Feed(session, "\x1b[2;5r");
+}
+
+// DECSTBM moves the cursor home, to the top left of the screen, and ignores regions of less than two rows
+static void TestSetRegion() {
+    term_session session;
+    Setup(session);
+    CheckCursor("DECSTBM moves the cursor home", session, 0, 0);
+
+    Feed(session, "\x1b[4;3H\x1b[5;2r");
+    CheckCursor("DECSTBM ignores an upside down region", session, 3, 2);
+    Feed(session, "\x1b[3;3r");
+    CheckCursor("DECSTBM ignores a single row region", session, 3, 2);
+    // the region set before still scrolls
+    Feed(session, "\x1b[5;1H\n");
+    CheckScreen("DECSTBM keeps the region after an invalid one", session, {"0", "2", "3", "4", "", "5"});
+
+    // without parameters the region is the whole screen again, and the cursor goes home too
+    Feed(session, "\x1b[4;3H\x1b[r");
+    CheckCursor("DECSTBM without parameters moves the cursor home", session, 0, 0);
+    uint64_t pushed = session.history->pushed;
+    Feed(session, "\x1b[6;1H\n");
+    Check("DECSTBM without parameters scrolls the whole screen", session.history->pushed == pushed + 1);
+    CheckScreen("DECSTBM without parameters", session, {"2", "3", "4", "", "5", ""});
+
+    // a bottom below the screen ends at the last row
+    Feed(session, "\x1b[3;99r\x1b[6;1H\n");
+    CheckScreen("DECSTBM clamps the bottom", session, {"2", "3", "", "5", "", ""});
+}
+
+// line feeds scroll the region at its bottom, and stop at the last row below it, neither goes to history
+static void TestLineFeed() {
+    term_session session;
+    Setup(session);
+    uint64_t pushed = session.history->pushed;
+
+    Feed(session, "\x1b[5;1H\nx");
+    CheckScreen("line feed at the bottom of the region", session, {"0", "2", "3", "4", "x", "5"});
+    CheckCursor("line feed at the bottom of the region", session, 4, 1);
+
+    Feed(session, "\x1b[6;1H\n\n");
+    CheckScreen("line feed below the region", session, {"0", "2", "3", "4", "x", "5"});
+    CheckCursor("line feed below the region", session, 5, 0);
+
+    Feed(session, "\x1b[1;1H\n");
+    CheckScreen("line feed above the region", session, {"0", "2", "3", "4", "x", "5"});
+    CheckCursor("line feed above the region", session, 1, 0);
+
+    // IND and NEL as well
+    Feed(session, "\x1b[5;3H\x1b" "D");
+    CheckScreen("IND at the bottom of the region", session, {"0", "3", "4", "x", "", "5"});
+    CheckCursor("IND at the bottom of the region", session, 4, 2);
+    Feed(session, "\x1b" "E");
+    CheckScreen("NEL at the bottom of the region", session, {"0", "4", "x", "", "", "5"});
+    CheckCursor("NEL at the bottom of the region", session, 4, 0);
+
+    Check("line feeds in a region push nothing to history", session.history->pushed == pushed);
+}
+
+// RI scrolls the region down at its top, and stops at the first row above it
+static void TestReverseIndex() {
+    term_session session;
+    Setup(session);
+    Feed(session, "\x1b[2;1H\x1bM");
+    CheckScreen("RI at the top of the region", session, {"0", "", "1", "2", "3", "5"});
+    CheckCursor("RI at the top of the region", session, 1, 0);
+
+    Feed(session, "\x1b[1;1H\x1bM");
+    CheckScreen("RI above the region", session, {"0", "", "1", "2", "3", "5"});
+    CheckCursor("RI above the region", session, 0, 0);
+}
+
+// IL and DL move the rows from the cursor to the bottom of the region, and do nothing outside it
+static void TestInsertDeleteLines() {
+    term_session session;
+    Setup(session);
+    Feed(session, "\x1b[3;4H\x1b[L");
+    CheckScreen("IL inside the region", session, {"0", "1", "", "2", "3", "5"});
+    CheckCursor("IL moves the cursor to the first column", session, 2, 0);
+    Feed(session, "\x1b[2;1H\x1b[9L");
+    CheckScreen("IL of more rows than the region", session, {"0", "", "", "", "", "5"});
+
+    term_session outside;
+    Setup(outside);
+    Feed(outside, "\x1b[1;3H\x1b[L");
+    CheckScreen("IL above the region", outside, {"0", "1", "2", "3", "4", "5"});
+    CheckCursor("IL above the region leaves the cursor", outside, 0, 2);
+    Feed(outside, "\x1b[6;3H\x1b[L");
+    CheckScreen("IL below the region", outside, {"0", "1", "2", "3", "4", "5"});
+
+    Feed(outside, "\x1b[3;4H\x1b[2M");
+    CheckScreen("DL inside the region", outside, {"0", "1", "4", "", "", "5"});
+    CheckCursor("DL moves the cursor to the first column", outside, 2, 0);
+
+    term_session bottom;
+    Setup(bottom);
+    Feed(bottom, "\x1b[5;1H\x1b[M");
+    CheckScreen("DL at the bottom of the region", bottom, {"0", "1", "2", "3", "", "5"});
+    Feed(bottom, "\x1b[1;1H\x1b[M\x1b[6;1H\x1b[M");
+    CheckScreen("DL outside the region", bottom, {"0", "1", "2", "3", "", "5"});
+}
+
+// SU and SD scroll the region wherever the cursor is, only SU of the whole main screen goes to history
+static void TestScrollUpDown() {
+    term_session session;
+    Setup(session);
+    uint64_t pushed = session.history->pushed;
+    Feed(session, "\x1b[3;2H\x1b[2S");
+    CheckScreen("SU inside the region", session, {"0", "3", "4", "", "", "5"});
+    CheckCursor("SU leaves the cursor", session, 2, 1);
+    Feed(session, "\x1b[1;1H\x1b[S");
+    CheckScreen("SU with the cursor above the region", session, {"0", "4", "", "", "", "5"});
+    Check("SU of a region pushes nothing to history", session.history->pushed == pushed);
+
+    term_session down;
+    Setup(down);
+    Feed(down, "\x1b[3;2H\x1b[T");
+    CheckScreen("SD inside the region", down, {"0", "", "1", "2", "3", "5"});
+    CheckCursor("SD leaves the cursor", down, 2, 1);
+    Feed(down, "\x1b[6;1H\x1b[9T");
+    CheckScreen("SD with the cursor below the region", down, {"0", "", "", "", "", "5"});
+
+    // the whole main screen
+    term_session full;
+    Resize(full, 4, 10);
+    Feed(full, "0\r\n1\r\n2\r\n3");
+    pushed = full.history->pushed;
+    Feed(full, "\x1b[2S");
+    CheckScreen("SU of the whole screen", full, {"2", "3", "", ""});
+    Check("SU of the whole screen pushes to history", full.history->pushed == pushed + 2);
+    Feed(full, "\x1b[T");
+    CheckScreen("SD of the whole screen", full, {"", "2", "3", ""});
+    Check("SD of the whole screen takes nothing from history", full.history->pushed == pushed + 2);
+}
+
+// a resize resets the region to the whole screen
+static void TestResize() {
+    term_session session;
+    Setup(session);
+    Resize(session, 5, 10);
+    uint64_t pushed = session.history->pushed;
+    Feed(session, "\x1b[5;1H\n");
+    Check("resize resets the region", session.history->pushed == pushed + 1);
+}
+
+int main() {
+    TestSetRegion();
+    TestLineFeed();
+    TestReverseIndex();
+    TestInsertDeleteLines();
+    TestScrollUpDown();
+    TestResize();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include "search.h"
+#include "history.h"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static char Lower(char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; }
+
+// the longest run of plain characters that every match of an extended regular expression contains
+// empty when there is none that is easy to tell, e.g. with alternation
+static std::string RequiredLiteral(const std::string &pattern) {
+    if (pattern.find('|') != std::string::npos) {
+        return "";
+    }
+    std::string best;
+    std::string run;
+    // characters within parentheses may be optional as a group
+    int depth = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+        if (c == '\\' && i + 1 < pattern.size() && ispunct((unsigned char)pattern[i + 1])) {
+            // an escaped special character stands for itself
+            c = pattern[++i];
+        } else if (c == '\\' || strchr(".[](){}*+?^$", c)) {
+            if (c == '\\') {
+                // e.g. \w
+                i++;
+            } else if (c == '[') {
+                // skip the bracket expression, a ] right after [ or [^ is part of it
+                i++;
+                if (i < pattern.size() && pattern[i] == '^') {
+                    i++;
+                }
+                if (i < pattern.size() && pattern[i] == ']') {
+                    i++;
+                }
+                while (i < pattern.size() && pattern[i] != ']') {
+                    i++;
+                }
+            } else if (c == '{') {
+                while (i < pattern.size() && pattern[i] != '}') {
+                    i++;
+                }
+            } else if (c == '(') {
+                depth++;
+            } else if (c == ')') {
+                depth--;
+            }
+            if (run.size() > best.size()) {
+                best = run;
+            }
+            run.clear();
+            continue;
+        }
+
+        // a character followed by ?, * or {} may be missing, one followed by + may repeat, which ends the run
+        char next = i + 1 < pattern.size() ? pattern[i + 1] : 0;
+        if (depth == 0 && next != '?' && next != '*' && next != '{') {
+            run += c;
+        } else if ((c & 0x80) != 0) {
+            // the quantifier applies to the whole utf8 sequence
+            while (!run.empty() && (run.back() & 0x80) != 0) {
+                run.pop_back();
+            }
+        }
+        if (depth > 0 || next == '?' || next == '*' || next == '{' || next == '+') {
+            if (run.size() > best.size()) {
+                best = run;
+            }
+            run.clear();
+        }
+    }
+    if (run.size() > best.size()) {
+        best = run;
+    }
+    return best;
+}
+
+search_pattern::~search_pattern() {
+    if (compiled) {
+        regfree(&regex);
+    }
+}
+
+bool search_pattern::Compile(const std::string &pattern, int new_flags) {
+    flags = new_flags;
+    if (pattern.empty()) {
+        return false;
+    }
+    if (flags & search_regex) {
+        int cflags = REG_EXTENDED | ((flags & search_ignore_case) ? REG_ICASE : 0);
+        if (regcomp(&regex, pattern.c_str(), cflags) != 0) {
+            return false;
+        }
+        compiled = true;
+        literal = RequiredLiteral(pattern);
+    } else {
+        literal = pattern;
+    }
+    if (flags & search_ignore_case) {
+        std::transform(literal.begin(), literal.end(), literal.begin(), Lower);
+        if ((flags & search_regex) &&
+            std::any_of(literal.begin(), literal.end(), [](char c) { return (c & 0x80) != 0; })) {
+            // the regular expression may fold letters beyond ascii, which the literal would not find
+            literal.clear();
+        }
+    }
+    return true;
+}
+
+// compare literal at data, with ascii letters of data folded to lowercase if fold is set
+static bool Equal(const uint8_t *data, const std::string &literal, bool fold) {
+    if (!fold) {
+        return memcmp(data, literal.data(), literal.size()) == 0;
+    }
+    for (size_t i = 0; i < literal.size(); i++) {
+        if (Lower(data[i]) != literal[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// offset of the first occurrence of literal in text at or after from, or npos
+// candidates are where both the first and the last byte of literal match, found 16 positions at a time
+static size_t FindLiteral(const std::string &text, size_t from, const std::string &literal, bool fold) {
+    size_t n = literal.size();
+    if (text.size() < n) {
+        return std::string::npos;
+    }
+    const uint8_t *data = (const uint8_t *)text.data();
+    // positions from here on are too close to the end
+    size_t end = text.size() - n + 1;
+    uint8_t first_byte = literal[0];
+    uint8_t last_byte = literal[n - 1];
+    // or'ing 0x20 folds ascii letters without affecting whether other bytes match, so only done for letters
+    uint8_t first_fold = fold && first_byte >= 'a' && first_byte <= 'z' ? 0x20 : 0;
+    uint8_t last_fold = fold && last_byte >= 'a' && last_byte <= 'z' ? 0x20 : 0;
+    size_t i = from;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(first_byte);
+    const __m128i last = _mm_set1_epi8(last_byte);
+    const __m128i first_or = _mm_set1_epi8(first_fold);
+    const __m128i last_or = _mm_set1_epi8(last_fold);
+    for (; i + 16 <= end; i += 16) {
+        __m128i head = _mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i)), first_or);
+        __m128i tail = _mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i + n - 1)), last_or);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (Equal(data + pos, literal, fold)) {
+                return pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t first = vdupq_n_u8(first_byte);
+    const uint8x16_t last = vdupq_n_u8(last_byte);
+    const uint8x16_t first_or = vdupq_n_u8(first_fold);
+    const uint8x16_t last_or = vdupq_n_u8(last_fold);
+    for (; i + 16 <= end; i += 16) {
+        uint8x16_t head = vorrq_u8(vld1q_u8(data + i), first_or);
+        uint8x16_t tail = vorrq_u8(vld1q_u8(data + i + n - 1), last_or);
+        if (vmaxvq_u8(vandq_u8(vceqq_u8(head, first), vceqq_u8(tail, last))) != 0) {
+            // rare, so the candidates are located one by one
+            for (size_t pos = i; pos < i + 16; pos++) {
+                if ((data[pos] | first_fold) == first_byte && Equal(data + pos, literal, fold)) {
+                    return pos;
+                }
+            }
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        if ((data[i] | first_fold) == first_byte && (data[i + n - 1] | last_fold) == last_byte &&
+            Equal(data + i, literal, fold)) {
+            return i;
+        }
+    }
+    return std::string::npos;
+}
+
+// byte ranges of the matches in text, oldest first
+static void FindMatches(const search_pattern &pattern, const std::string &text,
+                        std::vector<std::pair<size_t, size_t>> &ranges) {
+    bool fold = pattern.flags & search_ignore_case;
+    if (!(pattern.flags & search_regex)) {
+        size_t pos = 0;
+        while ((pos = FindLiteral(text, pos, pattern.literal, fold)) != std::string::npos) {
+            ranges.push_back({pos, pos + pattern.literal.size()});
+            pos += pattern.literal.size();
+        }
+        return;
+    }
+
+    if (!pattern.literal.empty() && FindLiteral(text, 0, pattern.literal, fold) == std::string::npos) {
+        return;
+    }
+    size_t pos = 0;
+    int eflags = 0;
+    regmatch_t match;
+    while (pos <= text.size() && regexec(&pattern.regex, text.c_str() + pos, 1, &match, eflags) == 0) {
+        size_t begin = pos + match.rm_so;
+        size_t end = pos + match.rm_eo;
+        if (end > begin) {
+            ranges.push_back({begin, end});
+            pos = end;
+        } else {
+            // empty matches are skipped, to the next utf8 sequence
+            pos = begin + 1;
+            while (pos < text.size() && (text[pos] & 0xc0) == 0x80) {
+                pos++;
+            }
+        }
+        eflags = REG_NOTBOL;
+    }
+}
+
+// number of cells, i.e. utf8 sequences, in text from begin to end
+static int CountCells(const std::string &text, size_t begin, size_t end) {
+    int cells = 0;
+    for (size_t i = begin; i < end; i++) {
+        if ((text[i] & 0xc0) != 0x80) {
+            cells++;
+        }
+    }
+    return cells;
+}
+
+bool SearchHistory(term_history *history, const search_pattern &pattern, uint64_t *end, int max_lines,
+                   size_t max_matches, std::vector<search_match> &matches) {
+    size_t limit = matches.size() + max_matches;
+    // the lines of a wrapped line and their numbers, newest first
+    std::vector<std::string> parts;
+    std::vector<uint64_t> numbers;
+    std::string text;
+    // byte offset in text where each line starts, oldest first
+    std::vector<size_t> starts;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    // the text of the line above *end and its number, if already copied
+    std::string part;
+    uint64_t line = 0;
+    bool have_part = false;
+    bool more = true;
+    for (int searched = 0; searched < max_lines && more && matches.size() < limit;) {
+        // gather the lines that wrap into the line above *end, until one that does not
+        bool wrapped = false;
+        if (!have_part) {
+            part.clear();
+            line = *end;
+            if (!history->GetTextBefore(&line, part, &wrapped)) {
+                return false;
+            }
+        }
+        parts.clear();
+        numbers.clear();
+        parts.push_back(std::move(part));
+        numbers.push_back(line);
+        have_part = false;
+        while (true) {
+            part.clear();
+            if (!history->GetTextBefore(&line, part, &wrapped)) {
+                // dropped, search what is left of the line
+                more = false;
+                break;
+            }
+            if (!wrapped) {
+                // the end of the next line
+                have_part = true;
+                break;
+            }
+            parts.push_back(std::move(part));
+            numbers.push_back(line);
+        }
+        searched += parts.size();
+        *end = numbers.back();
+
+        text.clear();
+        starts.clear();
+        for (auto it = parts.rbegin(); it != parts.rend(); it++) {
+            starts.push_back(text.size());
+            text += *it;
+        }
+        ranges.clear();
+        FindMatches(pattern, text, ranges);
+        for (auto it = ranges.rbegin(); it != ranges.rend() && matches.size() < limit; it++) {
+            // the line the match starts in
+            size_t index = std::upper_bound(starts.begin(), starts.end(), it->first) - starts.begin() - 1;
+            search_match match;
+            match.line = numbers[numbers.size() - 1 - index];
+            match.column = CountCells(text, starts[index], it->first);
+            match.length = CountCells(text, it->first, it->second);
+            matches.push_back(match);
+        }
+    }
+    return more && matches.size() < limit;
+}
@@ -0,0 +1,58 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <cstdint>
+#include <regex.h>
+#include <string>
+#include <vector>
+
+// scrollback search
+// lines are searched in the utf8 text history stores them with, so nothing is decoded, and soft-wrapped lines are
+// joined so that matches across the wrap are found. a literal that every match contains is looked for first,
+// comparing its first and last byte at 16 positions at once with simd, and only where both agree is the rest
+// compared, or the line handed to the regular expression.
+// no dependency on napi, so that benchmark can time it
+
+struct term_history;
+
+enum search_flags {
+    // ascii letters only
+    search_ignore_case = 1 << 0,
+    // the pattern is a posix extended regular expression
+    search_regex = 1 << 1,
+};
+
+// a line is numbered as by history.pushed, so that a match stays valid while output arrives, until it is dropped
+struct search_match {
+    uint64_t line;
+    // in cells
+    int column;
+    int length;
+};
+
+struct search_pattern {
+    int flags = 0;
+    // contained in every match, lowercase with search_ignore_case, may be empty with search_regex
+    std::string literal;
+    regex_t regex;
+    bool compiled = false;
+
+    search_pattern() = default;
+    search_pattern(const search_pattern &) = delete;
+    ~search_pattern();
+
+    // returns false if the pattern is empty or not a valid regular expression
+    bool Compile(const std::string &pattern, int flags);
+};
+
+// a search stops after this many matches, the newest ones, more are of no use to show
+#define SEARCH_MAX_MATCHES 10000
+
+// search the lines above the one numbered *end, newest first, appending matches newest first
+// stops at the start of a line after at least max_lines lines and moves *end up to it
+// returns false once no lines are left, or once max_matches matches are appended, any further ones are left out.
+// thread safe, history is locked only to copy the text of a line
+bool SearchHistory(term_history *history, const search_pattern &pattern, uint64_t *end, int max_lines,
+                   size_t max_matches, std::vector<search_match> &matches);
+
+#endif
@@ -0,0 +1,341 @@
+#include "history.h"
+#include "search.h"
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// headless checks of scrollback search: matches found with the literal prefilter are compared with those of plain
+// regexec over the same lines, for ascii, case folded and utf8 text, with lines soft-wrapped at random places
+// runs on plain linux, no napi, hilog or egl involved. exits with 1 if any check fails
+//
+// usage: search_test
+
+static int failures = 0;
+
+static void Check(const char *name, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n", name);
+        failures++;
+    }
+}
+
+// cells of utf8 text, one codepoint each
+static std::vector<term_char> Cells(const std::string &text) {
+    std::vector<term_char> cells;
+    for (size_t i = 0; i < text.size();) {
+        uint8_t byte = text[i];
+        int length = byte < 0x80 ? 1 : byte < 0xe0 ? 2 : byte < 0xf0 ? 3 : 4;
+        uint32_t codepoint = length == 1 ? byte : byte & (0x7f >> length);
+        for (int j = 1; j < length; j++) {
+            codepoint = (codepoint << 6) | (text[i + j] & 0x3f);
+        }
+        term_char c;
+        c.ch = codepoint;
+        cells.push_back(c);
+        i += length;
+    }
+    return cells;
+}
+
+// a line as pushed, in parts soft-wrapped into each other, and the numbers of the parts
+struct wrapped_line {
+    std::vector<std::string> parts;
+    std::vector<uint64_t> numbers;
+};
+
+static void Push(term_history &history, std::vector<wrapped_line> &lines, const std::vector<std::string> &parts) {
+    wrapped_line line;
+    for (size_t i = 0; i < parts.size(); i++) {
+        std::vector<term_char> cells = Cells(parts[i]);
+        line.numbers.push_back(history.pushed);
+        history.Push(cells.data(), cells.size(), i + 1 < parts.size());
+    }
+    line.parts = parts;
+    lines.push_back(line);
+}
+
+static int CountCells(const std::string &text, size_t begin, size_t end) {
+    int cells = 0;
+    for (size_t i = begin; i < end; i++) {
+        if ((text[i] & 0xc0) != 0x80) {
+            cells++;
+        }
+    }
+    return cells;
+}
+
+// matches of regex in lines, newest first, found with regexec alone
+static std::vector<search_match> Reference(const std::vector<wrapped_line> &lines, const regex_t &regex) {
+    std::vector<search_match> matches;
+    for (auto line = lines.rbegin(); line != lines.rend(); line++) {
+        std::string text;
+        std::vector<size_t> starts;
+        for (const std::string &part : line->parts) {
+            starts.push_back(text.size());
+            text += part;
+        }
+        std::vector<search_match> found;
+        size_t pos = 0;
+        int eflags = 0;
+        regmatch_t match;
+        while (pos <= text.size() && regexec(&regex, text.c_str() + pos, 1, &match, eflags) == 0) {
+            size_t begin = pos + match.rm_so;
+            size_t end = pos + match.rm_eo;
+            if (end > begin) {
+                size_t index = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+                found.push_back({line->numbers[index], CountCells(text, starts[index], begin),
+                                 CountCells(text, begin, end)});
+                pos = end;
+            } else {
+                pos = begin + 1;
+                while (pos < text.size() && (text[pos] & 0xc0) == 0x80) {
+                    pos++;
+                }
+            }
+            eflags = REG_NOTBOL;
+        }
+        matches.insert(matches.end(), found.rbegin(), found.rend());
+    }
+    return matches;
+}
+
+// all matches, in batches like the search thread
+static std::vector<search_match> Search(term_history &history, const std::string &pattern, int flags,
+                                        size_t max_matches = SIZE_MAX) {
+    search_pattern compiled;
+    std::vector<search_match> matches;
+    if (!compiled.Compile(pattern, flags)) {
+        fprintf(stderr, "FAIL compiling %s\n", pattern.c_str());
+        failures++;
+        return matches;
+    }
+    uint64_t end = history.pushed;
+    while (SearchHistory(&history, compiled, &end, 64, max_matches - matches.size(), matches)) {
+    }
+    return matches;
+}
+
+static bool operator==(const search_match &a, const search_match &b) {
+    return a.line == b.line && a.column == b.column && a.length == b.length;
+}
+
+static void CheckMatches(const char *name, const std::string &pattern, const std::vector<search_match> &matches,
+                         const std::vector<search_match> &expected) {
+    if (matches == expected) {
+        return;
+    }
+    fprintf(stderr, "FAIL %s, %s: %zu matches, expected %zu\n", name, pattern.c_str(), matches.size(),
+            expected.size());
+    for (size_t i = 0; i < std::max(matches.size(), expected.size()); i++) {
+        if (i < matches.size() && i < expected.size() && matches[i] == expected[i]) {
+            continue;
+        }
+        fprintf(stderr, "  first difference at %zu\n", i);
+        break;
+    }
+    failures++;
+}
+
+// pattern escaped so that regcomp takes it literally
+static std::string Escape(const std::string &literal) {
+    std::string escaped;
+    for (char c : literal) {
+        if (strchr(".[]()*+?{}|^$\\", c)) {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+// random text from a small alphabet, so that patterns match often, with multibyte sequences and mixed case
+// no blanks, which history trims at the end of a line
+static std::string RandomText(int length) {
+    static const char *pieces[] = {"a", "b", "A", "B", "x", "-", "é", "É", "日本", "€"};
+    std::string text;
+    for (int i = 0; i < length; i++) {
+        text += pieces[rand() % 10];
+    }
+    return text;
+}
+
+// the literal prefilter finds what regexec alone finds, across soft wraps and simd block boundaries
+static void TestPrefilter() {
+    term_history history;
+    std::vector<wrapped_line> lines;
+    srand(1);
+    for (int i = 0; i < 2000; i++) {
+        std::vector<std::string> parts;
+        int num_parts = rand() % 4 == 0 ? 1 + rand() % 3 : 1;
+        for (int j = 0; j < num_parts; j++) {
+            parts.push_back(RandomText(1 + rand() % 40));
+        }
+        Push(history, lines, parts);
+        // long literals are too rare in random text, a few lines have them, across wraps as well
+        if (i % 500 == 250) {
+            Push(history, lines, {RandomText(20) + "abababab-ABAB-é" + RandomText(20)});
+            Push(history, lines, {RandomText(12) + "abab", "abab-abAB-É" + RandomText(3)});
+        }
+    }
+
+    const char *literals[] = {"ab", "aB", "bab", "é", "éa", "日本", "x-x", "a€b", "abababab", "ABAB-é"};
+    for (const char *literal : literals) {
+        for (int fold = 0; fold < 2; fold++) {
+            regex_t regex;
+            regcomp(&regex, Escape(literal).c_str(), REG_EXTENDED | (fold ? REG_ICASE : 0));
+            std::vector<search_match> expected = Reference(lines, regex);
+            regfree(&regex);
+            Check("literals are found", !expected.empty());
+            int flags = fold ? search_ignore_case : 0;
+            CheckMatches(fold ? "literal, ignoring case" : "literal", literal, Search(history, literal, flags),
+                         expected);
+            CheckMatches(fold ? "escaped literal as regex, ignoring case" : "escaped literal as regex", literal,
+                         Search(history, Escape(literal), flags | search_regex), expected);
+        }
+    }
+
+    // the prefilter takes the literal every match contains, or none
+    const char *patterns[] = {"ab+a", "a(b|x)a", "[ab]-x", "x?-+é", "日本|€", "(ab){2}", "^a", "b$", "é+a", "A.B"};
+    for (const char *pattern : patterns) {
+        for (int fold = 0; fold < 2; fold++) {
+            regex_t regex;
+            regcomp(&regex, pattern, REG_EXTENDED | (fold ? REG_ICASE : 0));
+            std::vector<search_match> expected = Reference(lines, regex);
+            regfree(&regex);
+            int flags = search_regex | (fold ? search_ignore_case : 0);
+            CheckMatches(fold ? "regex, ignoring case" : "regex", pattern, Search(history, pattern, flags), expected);
+        }
+    }
+}
+
+// a match across a soft wrap is reported in the line it starts in, columns count cells, not bytes
+static void TestWrapped() {
+    term_history history;
+    std::vector<wrapped_line> lines;
+    Push(history, lines, {"first"});
+    Push(history, lines, {"é€ hel", "lo wor", "ld"});
+    Push(history, lines, {"hello"});
+    std::vector<search_match> matches = Search(history, "hello world", 0);
+    Check("match across wraps", matches.size() == 1 && matches[0].line == 1 && matches[0].column == 3 &&
+                                    matches[0].length == 11);
+    matches = Search(history, "lo", 0);
+    Check("matches newest first",
+          matches.size() == 2 && matches[0].line == 4 && matches[0].column == 3 && matches[1].line == 2 &&
+              matches[1].column == 0);
+    Check("no match across lines that do not wrap", Search(history, "firsté", 0).empty());
+}
+
+// only the newest SEARCH_MAX_MATCHES matches are reported, newest first
+static void TestMaxMatches() {
+    term_history history;
+    std::vector<wrapped_line> lines;
+    int num_lines = SEARCH_MAX_MATCHES * 3 / 4;
+    for (int i = 0; i < num_lines; i++) {
+        Push(history, lines, {"ab-ab"});
+    }
+    std::vector<search_match> matches = Search(history, "ab", 0, SEARCH_MAX_MATCHES);
+    Check("at most SEARCH_MAX_MATCHES matches", matches.size() == SEARCH_MAX_MATCHES);
+    bool newest_first = true;
+    for (size_t i = 0; i < matches.size(); i++) {
+        // two matches a line, the second one first
+        newest_first = newest_first && matches[i].line == (uint64_t)(num_lines - 1 - i / 2) &&
+                       matches[i].column == (i % 2 == 0 ? 3 : 0);
+    }
+    Check("the newest matches, newest first", newest_first);
+
+    // a cap reached at the end of a batch stops the search too
+    search_pattern pattern;
+    pattern.Compile("ab", 0);
+    uint64_t end = history.pushed;
+    matches.clear();
+    Check("a search stops with the matches it may take", !SearchHistory(&history, pattern, &end, 10, 20, matches));
+    Check("a search stops with exactly the matches it may take", matches.size() == 20);
+}
+
+// a search runs while another thread pushes lines, and drops or spills old ones
+struct pusher {
+    term_history *history;
+    std::atomic<bool> stop{false};
+    std::atomic<int> pushed{0};
+};
+
+static void *PushLines(void *arg) {
+    pusher *p = (pusher *)arg;
+    std::vector<term_char> cells = Cells("needle in a haystack of hay hay hay hay hay hay hay hay");
+    for (int i = 0; !p->stop.load() || i < 10000; i++) {
+        p->history->Push(cells.data(), cells.size(), i % 3 == 0);
+        p->pushed++;
+    }
+    return nullptr;
+}
+
+static void TestConcurrent(const char *name, const std::string &spill_dir) {
+    term_history history;
+    history.SetBudget(256 * 1024);
+    if (!spill_dir.empty()) {
+        // small enough that segments are dropped as well
+        history.SetSpill(spill_dir, 1);
+    }
+    std::vector<term_char> cells = Cells("needle in a haystack of hay hay hay hay hay hay hay hay");
+    for (int i = 0; i < 20000; i++) {
+        history.Push(cells.data(), cells.size(), i % 3 == 0);
+    }
+
+    pusher p;
+    p.history = &history;
+    pthread_t thread;
+    pthread_create(&thread, nullptr, PushLines, &p);
+    bool ordered = true;
+    bool columns = true;
+    size_t found = 0;
+    for (int round = 0; round < 20; round++) {
+        search_pattern pattern;
+        pattern.Compile(round % 2 ? "NEEDLE" : "needle i[n] a haystack", round % 2 ? search_ignore_case : search_regex);
+        std::vector<search_match> matches;
+        uint64_t end = history.pushed;
+        uint64_t start = end;
+        while (SearchHistory(&history, pattern, &end, 512, SIZE_MAX, matches)) {
+        }
+        for (size_t i = 0; i < matches.size(); i++) {
+            ordered = ordered && matches[i].line < start && (i == 0 || matches[i].line < matches[i - 1].line);
+            columns = columns && matches[i].column == 0 && matches[i].length == (round % 2 ? 6 : 20);
+        }
+        found += matches.size();
+    }
+    p.stop.store(true);
+    pthread_join(thread, nullptr);
+
+    std::string prefix = std::string(name) + ": ";
+    Check((prefix + "lines are pushed during the search").c_str(), p.pushed.load() > 0);
+    Check((prefix + "matches are found").c_str(), found > 0);
+    Check((prefix + "matches newest first, in lines searched").c_str(), ordered);
+    Check((prefix + "matches where the needle is").c_str(), columns);
+}
+
+int main() {
+    TestPrefilter();
+    TestWrapped();
+    TestMaxMatches();
+    TestConcurrent("dropping", "");
+    char spill_dir[] = "/tmp/search_test.XXXXXX";
+    if (mkdtemp(spill_dir)) {
+        TestConcurrent("spilling", spill_dir);
+        rmdir(spill_dir);
+    } else {
+        fprintf(stderr, "FAIL creating %s\n", spill_dir);
+        failures++;
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,1371 @@
+#include "terminal.h"
+#include "history.h"
+#include "trace.h"
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <deque>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// docs for escape codes:
+// https://invisible-island.net/xterm/ctlseqs/ctlseqs.html
+// https://vt100.net/docs/vt220-rm/chapter4.html
+// https://espterm.github.io/docs/VT100%20escape%20codes.html
+// https://ecma-international.org/wp-content/uploads/ECMA-48_5th_edition_june_1991.pdf
+// https://xtermjs.org/docs/api/vtfeatures/
+// parser state machine:
+// https://vt100.net/emu/dec_ansi_parser
+
+// actions performed on a byte, before moving to the next state
+enum escape_actions {
+    action_ignore,
+    // printable character or utf8 byte
+    action_print,
+    // C0 control
+    action_execute,
+    // private marker or intermediate byte
+    action_collect,
+    // digit or separator of parameters
+    action_param,
+    action_esc_dispatch,
+    action_csi_dispatch,
+};
+// parser_table[state][byte] = (action << 4) | next state
+static uint8_t parser_table[NUM_ESCAPE_STATES][256];
+
+float color_table[color_truecolor_base][3];
+
+// 8 basic colors, for SGR 30-37, 40-47 and the first 16 entries of 256 colors
+static const float basic_colors[8][3] = {
+    {0.0, 0.0, 0.0}, // black
+    {1.0, 0.0, 0.0}, // red
+    {0.0, 1.0, 0.0}, // green
+    {1.0, 1.0, 0.0}, // yellow
+    {0.0, 0.0, 1.0}, // blue
+    {1.0, 0.0, 1.0}, // magenta
+    {0.0, 1.0, 1.0}, // cyan
+    {1.0, 1.0, 1.0}, // white
+};
+
+static void SetColor(float *rgb, float red, float green, float blue) {
+    rgb[0] = red;
+    rgb[1] = green;
+    rgb[2] = blue;
+}
+
+// fill the palette part of color_table once
+static bool BuildColorTable() {
+    for (int i = 0; i < 16; i++) {
+        SetColor(color_table[i], basic_colors[i % 8][0], basic_colors[i % 8][1], basic_colors[i % 8][2]);
+    }
+    // bright black
+    SetColor(color_table[8], 0.5, 0.5, 0.5);
+
+    // 6x6x6 color cube
+    static const int levels[6] = {0, 95, 135, 175, 215, 255};
+    for (int i = 0; i < 216; i++) {
+        SetColor(color_table[16 + i], levels[i / 36] / 255.0, levels[i / 6 % 6] / 255.0, levels[i % 6] / 255.0);
+    }
+
+    // grayscale ramp
+    for (int i = 0; i < 24; i++) {
+        float level = (8 + i * 10) / 255.0;
+        SetColor(color_table[232 + i], level, level, level);
+    }
+
+    SetColor(color_table[color_default_fg], 0.0, 0.0, 0.0);
+    SetColor(color_table[color_default_bg], 1.0, 1.0, 1.0);
+    return true;
+}
+static bool color_table_built = BuildColorTable();
+
+static void SetRange(escape_states state, int from, int to, escape_actions action, escape_states next) {
+    for (int i = from; i <= to; i++) {
+        parser_table[state][i] = (action << 4) | next;
+    }
+}
+
+// C0 controls, except CAN, SUB and ESC which are handled in every state
+static void SetC0(escape_states state, escape_actions action) {
+    SetRange(state, 0x00, 0x17, action, state_stay);
+    SetRange(state, 0x19, 0x19, action, state_stay);
+    SetRange(state, 0x1c, 0x1f, action, state_stay);
+}
+
+// build the state table once, following https://vt100.net/emu/dec_ansi_parser
+// 0x80-0xff are utf8 bytes instead of C1 controls
+static bool BuildParserTable() {
+    for (int state = 0; state < NUM_ESCAPE_STATES; state++) {
+        SetRange((escape_states)state, 0x00, 0xff, action_ignore, state_stay);
+    }
+
+    // ground
+    SetC0(state_ground, action_execute);
+    SetRange(state_ground, 0x20, 0x7e, action_print, state_stay);
+    SetRange(state_ground, 0x80, 0xff, action_print, state_stay);
+
+    // ESC
+    SetC0(state_esc, action_execute);
+    SetRange(state_esc, 0x20, 0x2f, action_collect, state_esc_intermediate);
+    SetRange(state_esc, 0x30, 0x7e, action_esc_dispatch, state_ground);
+    SetRange(state_esc, '[', '[', action_ignore, state_csi_entry);
+    SetRange(state_esc, ']', ']', action_ignore, state_osc_string);
+    SetRange(state_esc, 'P', 'P', action_ignore, state_dcs_entry);
+    SetRange(state_esc, 'X', 'X', action_ignore, state_sos_pm_apc_string);
+    SetRange(state_esc, '^', '_', action_ignore, state_sos_pm_apc_string);
+
+    SetC0(state_esc_intermediate, action_execute);
+    SetRange(state_esc_intermediate, 0x20, 0x2f, action_collect, state_stay);
+    SetRange(state_esc_intermediate, 0x30, 0x7e, action_esc_dispatch, state_ground);
+
+    // CSI
+    // ':' separates sub-parameters, e.g. CSI 38:2:r:g:b m, they are marked in sub_params
+    SetC0(state_csi_entry, action_execute);
+    SetRange(state_csi_entry, 0x20, 0x2f, action_collect, state_csi_intermediate);
+    SetRange(state_csi_entry, 0x30, 0x3b, action_param, state_csi_param);
+    SetRange(state_csi_entry, 0x3c, 0x3f, action_collect, state_csi_param);
+    SetRange(state_csi_entry, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+    SetC0(state_csi_param, action_execute);
+    SetRange(state_csi_param, 0x20, 0x2f, action_collect, state_csi_intermediate);
+    SetRange(state_csi_param, 0x30, 0x3b, action_param, state_stay);
+    SetRange(state_csi_param, 0x3c, 0x3f, action_ignore, state_csi_ignore);
+    SetRange(state_csi_param, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+    SetC0(state_csi_intermediate, action_execute);
+    SetRange(state_csi_intermediate, 0x20, 0x2f, action_collect, state_stay);
+    SetRange(state_csi_intermediate, 0x30, 0x3f, action_ignore, state_csi_ignore);
+    SetRange(state_csi_intermediate, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+    SetC0(state_csi_ignore, action_execute);
+    SetRange(state_csi_ignore, 0x40, 0x7e, action_ignore, state_ground);
+
+    // OSC, the content is not used
+    // terminated by BEL, or ST (ESC \) via the ESC transition below
+    SetRange(state_osc_string, 0x07, 0x07, action_ignore, state_ground);
+
+    // DCS, the content is not used, terminated by ST (ESC \)
+    SetRange(state_dcs_entry, 0x20, 0x2f, action_collect, state_dcs_intermediate);
+    SetRange(state_dcs_entry, 0x30, 0x39, action_param, state_dcs_param);
+    SetRange(state_dcs_entry, 0x3a, 0x3a, action_ignore, state_dcs_ignore);
+    SetRange(state_dcs_entry, 0x3b, 0x3b, action_param, state_dcs_param);
+    SetRange(state_dcs_entry, 0x3c, 0x3f, action_collect, state_dcs_param);
+    SetRange(state_dcs_entry, 0x40, 0x7e, action_ignore, state_dcs_passthrough);
+
+    SetRange(state_dcs_param, 0x20, 0x2f, action_collect, state_dcs_intermediate);
+    SetRange(state_dcs_param, 0x30, 0x39, action_param, state_stay);
+    SetRange(state_dcs_param, 0x3a, 0x3a, action_ignore, state_dcs_ignore);
+    SetRange(state_dcs_param, 0x3b, 0x3b, action_param, state_stay);
+    SetRange(state_dcs_param, 0x3c, 0x3f, action_ignore, state_dcs_ignore);
+    SetRange(state_dcs_param, 0x40, 0x7e, action_ignore, state_dcs_passthrough);
+
+    SetRange(state_dcs_intermediate, 0x20, 0x2f, action_collect, state_stay);
+    SetRange(state_dcs_intermediate, 0x30, 0x3f, action_ignore, state_dcs_ignore);
+    SetRange(state_dcs_intermediate, 0x40, 0x7e, action_ignore, state_dcs_passthrough);
+
+    // anywhere: CAN and SUB cancel the sequence, ESC starts a new one
+    for (int state = 0; state < NUM_ESCAPE_STATES; state++) {
+        SetRange((escape_states)state, 0x18, 0x18, action_execute, state_ground);
+        SetRange((escape_states)state, 0x1a, 0x1a, action_execute, state_ground);
+        SetRange((escape_states)state, 0x1b, 0x1b, action_ignore, state_esc);
+    }
+    return true;
+}
+static bool parser_table_built = BuildParserTable();
+
+term_session::term_session() : history(new term_history) {
+    // all truecolor entries start out free, lowest index first, so the first ones need no reclaim
+    free_truecolors.reserve(NUM_COLORS - color_truecolor_base);
+    for (int index = NUM_COLORS - 1; index >= color_truecolor_base; index--) {
+        free_truecolors.push_back(index);
+    }
+}
+
+// out of line, where term_history is complete
+term_session::~term_session() {}
+
+// called when the cursor moved down a row, scrolls if it left the scroll region at the bottom
+void term_session::DropFirstRowIfOverflow() {
+    if (row == scroll_bottom + 1 && (scroll_top > 0 || scroll_bottom < term_row - 1)) {
+        // only the region scrolls, nothing goes to history
+        terminal.ScrollUp(scroll_top, scroll_bottom, 1);
+        row--;
+    } else if (row == term_row && scroll_bottom < term_row - 1) {
+        // below the scroll region, the cursor stays on the last row
+        row--;
+    } else if (row == term_row) {
+        // drop first row into history, rows scrolled off the alternate screen are gone
+        if (!alternate_screen) {
+            history->Push(terminal.Row(0).data(), term_col, terminal.Wrapped(0));
+        }
+
+        // the first row becomes the new last row
+        terminal.RotateUp();
+        std::fill(terminal[term_row - 1].begin(), terminal[term_row - 1].end(), term_char());
+        terminal.SetWrapped(term_row - 1, false);
+        row--;
+    }
+}
+
+// swap the main and the alternate screen, which exchanges pointers only
+void term_session::SwitchScreen(bool alternate) {
+    if (alternate == alternate_screen) {
+        return;
+    }
+    // every row may differ from the one the renderer has at the same index, so all count as changed,
+    // with generations newer than those of either screen
+    uint64_t last_generation = std::max(terminal.last_generation, other_screen.last_generation);
+    std::swap(terminal, other_screen);
+    terminal.last_generation = last_generation;
+    terminal.TouchAll();
+    alternate_screen = alternate;
+}
+
+void term_session::SaveCursor() {
+    saved_cursor &saved = saved_cursors[alternate_screen];
+    saved.row = row;
+    saved.col = col;
+    saved.style = current_style;
+}
+
+void term_session::RestoreCursor() {
+    const saved_cursor &saved = saved_cursors[alternate_screen];
+    row = std::min(saved.row, term_row - 1);
+    col = std::min(saved.col, term_col - 1);
+    current_style = saved.style;
+}
+
+#define clamp_row()                                                                                                    \
+    do {                                                                                                               \
+        if (row < 0) {                                                                                                 \
+            row = 0;                                                                                                   \
+        } else if (row > term_row - 1) {                                                                               \
+            row = term_row - 1;                                                                                        \
+        }                                                                                                              \
+    } while (0);
+
+#define clamp_col()                                                                                                    \
+    do {                                                                                                               \
+        if (col < 0) {                                                                                                 \
+            col = 0;                                                                                                   \
+        } else if (col > term_col - 1) {                                                                               \
+            col = term_col - 1;                                                                                        \
+        }                                                                                                              \
+    } while (0);
+
+// read the i-th parameter, missing or zero parameters take the default value
+int term_session::ParamOrDefault(int i, int def) {
+    if (i >= num_params || params[i] == 0) {
+        return def;
+    }
+    return params[i];
+}
+
+// read the i-th parameter, missing parameters are zero
+int term_session::Param(int i) { return i < num_params ? params[i] : 0; }
+
+static uint64_t NowMsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// combine intermediate bytes and the final byte for dispatching
+// e.g. CSI ? Pm h is dispatch_key('?', 0, 'h')
+#define dispatch_key(first, second, final) (((first) << 16) | ((second) << 8) | (final))
+
+void term_session::InsertUtf8(uint32_t codepoint) {
+    assert(row >= 0 && row < term_row);
+    assert(col >= 0 && col < term_col);
+    terminal[row][col].ch = codepoint;
+    terminal[row][col].style = current_style;
+    col++;
+    if (col == term_col) {
+        terminal.SetWrapped(row, true);
+        col = 0;
+        row++;
+        DropFirstRowIfOverflow();
+    }
+}
+
+// insert a run of printable ascii with the current style, wrapping one row at a time
+void term_session::InsertPrintable(const uint8_t *data, size_t count) {
+    assert(row >= 0 && row < term_row);
+    assert(col >= 0 && col < term_col);
+    while (count > 0) {
+        size_t n = std::min((size_t)(term_col - col), count);
+        term_char *cells = &terminal[row][col];
+        for (size_t i = 0; i < n; i++) {
+            cells[i].ch = data[i];
+            cells[i].style = current_style;
+        }
+        data += n;
+        count -= n;
+        col += n;
+        if (col == term_col) {
+            terminal.SetWrapped(row, true);
+            col = 0;
+            row++;
+            DropFirstRowIfOverflow();
+        }
+    }
+}
+
+// length of the leading run of printable ascii (0x20 to 0x7e)
+static size_t ScanPrintable(const uint8_t *data, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i lower = _mm_set1_epi8(0x1f);
+    const __m128i upper = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        // signed comparison: 0x80 to 0xff are negative, so they fail the lower bound
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, lower), _mm_cmplt_epi8(bytes, upper));
+        unsigned int mask = _mm_movemask_epi8(printable);
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t lower = vdupq_n_u8(0x20);
+    const uint8x16_t upper = vdupq_n_u8(0x7e);
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t bytes = vld1q_u8(data + i);
+        uint8x16_t printable = vandq_u8(vcgeq_u8(bytes, lower), vcleq_u8(bytes, upper));
+        if (vminvq_u8(printable) != 0xff) {
+            // the scalar loop below locates the first non-printable byte in this block
+            break;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (data[i] < 0x20 || data[i] > 0x7e) {
+            break;
+        }
+    }
+    return i;
+}
+
+void term_session::DecodeUtf8(uint8_t byte) {
+    if (utf8_state == state_initial) {
+        if (byte < 0x80) {
+            // printable
+            InsertUtf8(byte);
+        } else if (byte >= 0xc2 && byte <= 0xdf) {
+            // 2-byte utf8
+            utf8_state = state_2byte_2;
+            current_utf8 = (uint32_t)(byte & 0x1f) << 6;
+        } else if (byte == 0xe0) {
+            // 3-byte utf8 starting with e0
+            utf8_state = state_3byte_2_e0;
+            current_utf8 = (uint32_t)(byte & 0x0f) << 12;
+        } else if (byte >= 0xe1 && byte <= 0xef) {
+            // 3-byte utf8 starting with non-e0
+            utf8_state = state_3byte_2_non_e0;
+            current_utf8 = (uint32_t)(byte & 0x0f) << 12;
+        } else if (byte == 0xf0) {
+            // 4-byte utf8 starting with f0
+            utf8_state = state_4byte_2_f0;
+            current_utf8 = (uint32_t)(byte & 0x07) << 18;
+        } else if (byte >= 0xf1 && byte <= 0xf3) {
+            // 4-byte utf8 starting with f1 to f3
+            utf8_state = state_4byte_2_f1_f3;
+            current_utf8 = (uint32_t)(byte & 0x07) << 18;
+        } else if (byte == 0xf4) {
+            // 4-byte utf8 starting with f4
+            utf8_state = state_4byte_2_f4;
+            current_utf8 = (uint32_t)(byte & 0x07) << 18;
+        }
+    } else if (utf8_state == state_2byte_2) {
+        // expecting the second byte of 2-byte utf-8
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (byte & 0x3f);
+            InsertUtf8(current_utf8);
+        }
+        utf8_state = state_initial;
+    } else if (utf8_state == state_3byte_2_e0) {
+        // expecting the second byte of 3-byte utf-8 starting with 0xe0
+        if (byte >= 0xa0 && byte <= 0xbf) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 6;
+            utf8_state = state_3byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_3byte_2_non_e0) {
+        // expecting the second byte of 3-byte utf-8 starting with non-0xe0
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 6;
+            utf8_state = state_3byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_3byte_3) {
+        // expecting the third byte of 3-byte utf-8 starting with 0xe0
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (byte & 0x3f);
+            InsertUtf8(current_utf8);
+        }
+        utf8_state = state_initial;
+    } else if (utf8_state == state_4byte_2_f0) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf0
+        if (byte >= 0x90 && byte <= 0xbf) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_2_f1_f3) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf0 to 0xf3
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_2_f4) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf4
+        if (byte >= 0x80 && byte <= 0x8f) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_3) {
+        // expecting the third byte of 4-byte utf-8
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (uint32_t)(byte & 0x3f) << 6;
+            utf8_state = state_4byte_4;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_4) {
+        // expecting the third byte of 4-byte utf-8
+        if (byte >= 0x80 && byte <= 0xbf) {
+            current_utf8 |= (byte & 0x3f);
+            InsertUtf8(current_utf8);
+        }
+        utf8_state = state_initial;
+    } else {
+        assert(false && "unreachable utf8 state");
+    }
+}
+
+// C0 control characters
+void term_session::Execute(uint8_t byte) {
+    if (byte == '\r') {
+        col = 0;
+    } else if (byte == '\n' || byte == '\v' || byte == '\f') {
+        row += 1;
+        DropFirstRowIfOverflow();
+    } else if (byte == '\b') {
+        if (col > 0) {
+            col -= 1;
+        }
+    } else if (byte == '\t') {
+        col = (col + 8) / 8 * 8;
+        if (col >= term_col) {
+            col = 0;
+            row++;
+            DropFirstRowIfOverflow();
+        }
+    }
+}
+
+void term_session::Collect(uint8_t byte) {
+    if (num_intermediates < MAX_INTERMEDIATES) {
+        intermediates[num_intermediates++] = byte;
+    } else {
+        intermediates_overflow = true;
+    }
+}
+
+void term_session::CollectParam(uint8_t byte) {
+    if (num_params == 0) {
+        num_params = 1;
+        params[0] = 0;
+    }
+    if (byte == ';' || byte == ':') {
+        if (num_params < MAX_PARAMS) {
+            if (byte == ':') {
+                sub_params |= 1 << num_params;
+            }
+            params[num_params++] = 0;
+        } else {
+            // extra parameters are dropped
+            params_overflow = true;
+        }
+    } else if (!params_overflow) {
+        int value = params[num_params - 1] * 10 + (byte - '0');
+        params[num_params - 1] = value > MAX_PARAM_VALUE ? MAX_PARAM_VALUE : value;
+    }
+}
+
+// clear parameters and intermediates on entering ESC, CSI or DCS
+void term_session::Clear() {
+    num_params = 0;
+    sub_params = 0;
+    params_overflow = false;
+    num_intermediates = 0;
+    intermediates_overflow = false;
+}
+
+void term_session::EscDispatch(uint8_t final) {
+    int key = dispatch_key(num_intermediates > 0 ? intermediates[0] : 0, num_intermediates > 1 ? intermediates[1] : 0,
+                           final);
+    switch (key) {
+    case dispatch_key(0, 0, '='):
+        // ESC =, enter alternate keypad mode
+        // TODO
+        break;
+    case dispatch_key(0, 0, '>'):
+        // ESC >, exit alternate keypad mode
+        // TODO
+        break;
+    case dispatch_key(0, 0, '\\'):
+        // ESC \, ST, string terminator of OSC/DCS
+        break;
+    case dispatch_key(0, 0, 'D'):
+        // ESC D, IND, index
+        row++;
+        DropFirstRowIfOverflow();
+        break;
+    case dispatch_key(0, 0, 'E'):
+        // ESC E, NEL, next line
+        col = 0;
+        row++;
+        DropFirstRowIfOverflow();
+        break;
+    case dispatch_key(0, 0, 'M'):
+        // ESC M, RI, reverse index, scrolls the region down at its top
+        if (row == scroll_top) {
+            terminal.ScrollDown(scroll_top, scroll_bottom, 1);
+        } else if (row > 0) {
+            row--;
+        }
+        break;
+    case dispatch_key(0, 0, '7'):
+        // ESC 7, DECSC, save cursor
+        SaveCursor();
+        break;
+    case dispatch_key(0, 0, '8'):
+        // ESC 8, DECRC, restore cursor
+        RestoreCursor();
+        break;
+    case dispatch_key('(', 0, 'B'):
+    case dispatch_key('(', 0, '0'):
+        // ESC ( C, designate G0 character set
+        // TODO
+        break;
+    default:
+        TraceEvent(trace_unknown_esc, key >> 8, final);
+        break;
+    }
+}
+
+// find or allocate the color index for an rgb color
+// when all entries are in use, fall back to the nearest entry of the color cube
+int term_session::TrueColor(int red, int green, int blue) {
+    uint32_t rgb = (red << 16) | (green << 8) | blue;
+    auto it = truecolors.find(rgb);
+    if (it != truecolors.end()) {
+        return it->second;
+    }
+
+    // a reclaim that found nothing is only retried after a while, as it scans all cells
+    if (free_truecolors.empty() && truecolor_fallbacks % TRUECOLOR_RECLAIM_INTERVAL == 0) {
+        ReclaimTrueColors();
+    }
+    if (free_truecolors.empty()) {
+        truecolor_fallbacks++;
+        return 16 + (red * 5 + 127) / 255 * 36 + (green * 5 + 127) / 255 * 6 + (blue * 5 + 127) / 255;
+    }
+    int index = free_truecolors.back();
+    free_truecolors.pop_back();
+    SetColor(truecolor_table[index - color_truecolor_base], red / 255.0, green / 255.0, blue / 255.0);
+    truecolors[rgb] = index;
+    return index;
+}
+
+static void MarkColors(const std::vector<std::vector<term_char>> &rows, color_set &used) {
+    for (const std::vector<term_char> &cells : rows) {
+        for (const term_char &c : cells) {
+            used[c.style.fg] = true;
+            used[c.style.bg] = true;
+        }
+    }
+}
+
+// free the truecolor entries that no cell refers to, on either screen, in a snapshot or in history
+// snapshots count as the renderer may still be drawing one
+void term_session::ReclaimTrueColors() {
+    color_set used;
+    MarkColors(terminal.rows, used);
+    MarkColors(other_screen.rows, used);
+    for (const term_snapshot &snapshot : snapshots) {
+        MarkColors(snapshot.rows, used);
+    }
+    for (const style &s : {current_style, saved_cursors[0].style, saved_cursors[1].style}) {
+        used[s.fg] = true;
+        used[s.bg] = true;
+    }
+    history->MarkColors(used);
+
+    for (auto it = truecolors.begin(); it != truecolors.end();) {
+        if (used[it->second]) {
+            it++;
+        } else {
+            it = truecolors.erase(it);
+        }
+    }
+    // lowest index first
+    free_truecolors.clear();
+    for (int index = NUM_COLORS - 1; index >= color_truecolor_base; index--) {
+        if (!used[index]) {
+            free_truecolors.push_back(index);
+        }
+    }
+    if (!free_truecolors.empty()) {
+        truecolor_fallbacks = 0;
+    }
+}
+
+// parse extended color at params[i], CSI 38 ; 5 ; Ps m or CSI 38 ; 2 ; Pr ; Pg ; Pb m
+// or with sub-parameters, CSI 38 : 5 : Ps m, CSI 38 : 2 : Pr : Pg : Pb m or CSI 38 : 2 : Pi : Pr : Pg : Pb m
+// returns the color index, or -1 if invalid, and advances i past the sub-parameters
+int term_session::ExtendedColor(int &i) {
+    // with ':', only the sub-parameters of params[i] belong to the color
+    int end = i + 1;
+    while (end < num_params && (sub_params >> end & 1)) {
+        end++;
+    }
+    bool colon = end > i + 1;
+    if (!colon) {
+        end = num_params;
+    }
+
+    int color = -1;
+    int last = end - 1;
+    if (i + 2 < end && params[i + 1] == 5) {
+        // 256 colors
+        last = i + 2;
+        color = params[last] < 256 ? params[last] : -1;
+    } else if (i + 1 < end && params[i + 1] == 2) {
+        // truecolor, the ITU form has a colorspace id, often left empty, before the rgb
+        int first = colon && end - i == 6 ? i + 3 : i + 2;
+        if (first + 2 < end) {
+            last = first + 2;
+            if (params[first] <= 255 && params[first + 1] <= 255 && params[first + 2] <= 255) {
+                color = TrueColor(params[first], params[first + 1], params[first + 2]);
+            }
+        }
+    }
+    i = colon ? end - 1 : last;
+    return color;
+}
+
+// CSI Pm m, Character Attributes (SGR)
+void term_session::SelectGraphicRendition() {
+    if (num_params == 0) {
+        // reset all attributes to their defaults
+        current_style = style();
+        return;
+    }
+
+    for (int i = 0; i < num_params; i++) {
+        if (sub_params >> i & 1) {
+            // sub-parameters other than those of colors, e.g. the underline style of CSI 4:3 m, are not supported
+            continue;
+        }
+        int param = params[i];
+        if (param == 0) {
+            // reset all attributes to their defaults
+            current_style = style();
+        } else if (param == 1) {
+            // set bold
+            current_style.attrs |= attr_bold;
+        } else if (param == 7) {
+            // inverse
+            int fg = current_style.fg;
+            current_style.fg = current_style.bg;
+            current_style.bg = fg;
+        } else if (param == 10) {
+            // reset to primary font
+            current_style = style();
+        } else if (param >= 30 && param <= 37) {
+            // foreground color
+            current_style.fg = param - 30;
+        } else if (param == 38) {
+            // extended foreground color
+            int color = ExtendedColor(i);
+            if (color != -1) {
+                current_style.fg = color;
+            }
+        } else if (param == 39) {
+            // default foreground
+            current_style.fg = color_default_fg;
+        } else if (param >= 40 && param <= 47) {
+            // background color
+            current_style.bg = param - 40;
+        } else if (param == 48) {
+            // extended background color
+            int color = ExtendedColor(i);
+            if (color != -1) {
+                current_style.bg = color;
+            }
+        } else if (param == 49) {
+            // default background
+            current_style.bg = color_default_bg;
+        } else if (param >= 90 && param <= 97) {
+            // bright foreground color
+            current_style.fg = param - 90 + 8;
+        } else if (param >= 100 && param <= 107) {
+            // bright background color
+            current_style.bg = param - 100 + 8;
+        } else {
+            TraceEvent(trace_unknown_sgr, param, 0);
+        }
+    }
+}
+
+void term_session::CsiDispatch(uint8_t final) {
+    if (intermediates_overflow) {
+        return;
+    }
+
+    int key = dispatch_key(num_intermediates > 0 ? intermediates[0] : 0, num_intermediates > 1 ? intermediates[1] : 0,
+                           final);
+    switch (key) {
+    case dispatch_key(0, 0, 'A'):
+        // CSI Ps A, CUU, move cursor up # lines, stopping at the top margin
+        if (row >= scroll_top) {
+            row = std::max(row - ParamOrDefault(0, 1), scroll_top);
+        } else {
+            row -= ParamOrDefault(0, 1);
+            clamp_row();
+        }
+        break;
+    case dispatch_key(0, 0, 'B'):
+        // CSI Ps B, CUD, move cursor down # lines, stopping at the bottom margin
+        if (row <= scroll_bottom) {
+            row = std::min(row + ParamOrDefault(0, 1), scroll_bottom);
+        } else {
+            row += ParamOrDefault(0, 1);
+            clamp_row();
+        }
+        break;
+    case dispatch_key(0, 0, 'C'):
+        // CSI Ps C, CUF, move cursor right # columns
+        col += ParamOrDefault(0, 1);
+        clamp_col();
+        break;
+    case dispatch_key(0, 0, 'D'):
+        // CSI Ps D, CUB, move cursor left # columns
+        col -= ParamOrDefault(0, 1);
+        clamp_col();
+        break;
+    case dispatch_key(0, 0, 'E'):
+        // CSI Ps E, CNL, move cursor to the beginning of next line, down # lines
+        row += ParamOrDefault(0, 1);
+        clamp_row();
+        col = 0;
+        break;
+    case dispatch_key(0, 0, 'F'):
+        // CSI Ps F, CPL, move cursor to the beginning of previous line, up # lines
+        row -= ParamOrDefault(0, 1);
+        clamp_row();
+        col = 0;
+        break;
+    case dispatch_key(0, 0, 'G'):
+        // CSI Ps G, CHA, move cursor to column #
+        // convert from 1-based to 0-based
+        col = ParamOrDefault(0, 1) - 1;
+        clamp_col();
+        break;
+    case dispatch_key(0, 0, 'H'):
+        // CSI Ps ; PS H, CUP, move cursor to x, y, default to upper left corner
+        // convert from 1-based to 0-based
+        row = ParamOrDefault(0, 1) - 1;
+        col = ParamOrDefault(1, 1) - 1;
+        clamp_row();
+        clamp_col();
+        break;
+    case dispatch_key(0, 0, 'J'):
+        // CSI Ps J, ED, erase in display
+        if (Param(0) == 0) {
+            // erase below
+            for (int i = col; i < term_col; i++) {
+                terminal[row][i] = term_char();
+            }
+            terminal.SetWrapped(row, false);
+            for (int i = row + 1; i < term_row; i++) {
+                std::fill(terminal[i].begin(), terminal[i].end(), term_char());
+                terminal.SetWrapped(i, false);
+            }
+        } else if (Param(0) == 1) {
+            // erase above
+            for (int i = 0; i < row; i++) {
+                std::fill(terminal[i].begin(), terminal[i].end(), term_char());
+                terminal.SetWrapped(i, false);
+            }
+            for (int i = 0; i <= col; i++) {
+                terminal[row][i] = term_char();
+            }
+        } else if (Param(0) == 2) {
+            // erase all
+            for (int i = 0; i < term_row; i++) {
+                std::fill(terminal[i].begin(), terminal[i].end(), term_char());
+                terminal.SetWrapped(i, false);
+            }
+        }
+        break;
+    case dispatch_key(0, 0, 'K'):
+        // CSI Ps K, EL, erase in line
+        if (Param(0) == 0) {
+            // erase to right, the row ends here now
+            for (int i = col; i < term_col; i++) {
+                terminal[row][i] = term_char();
+            }
+            terminal.SetWrapped(row, false);
+        } else if (Param(0) == 1) {
+            // erase to left
+            for (int i = 0; i <= col; i++) {
+                terminal[row][i] = term_char();
+            }
+        }
+        break;
+    case dispatch_key(0, 0, 'P'): {
+        // CSI Ps P, DCH, delete # characters, move right to left
+        int del = ParamOrDefault(0, 1);
+        for (int i = col; i < term_col; i++) {
+            if (i + del < term_col) {
+                terminal[row][i] = terminal[row][i + del];
+            } else {
+                terminal[row][i] = term_char();
+            }
+        }
+        break;
+    }
+    case dispatch_key(0, 0, 'X'): {
+        // CSI Ps X, ECH, erase # characters, do not move others
+        int del = ParamOrDefault(0, 1);
+        for (int i = col; i < col + del && i < term_col; i++) {
+            terminal[row][i] = term_char();
+        }
+        break;
+    }
+    case dispatch_key(0, 0, 'c'): {
+        // CSI Ps c, Send Device Attributes
+        // send CSI ? 6 c: I am VT102
+        uint8_t send_buffer[] = {0x1b, '[', '?', '6', 'c'};
+        QueueWrite(send_buffer, sizeof(send_buffer));
+        break;
+    }
+    case dispatch_key(0, 0, 'd'):
+        // CSI Ps d, VPA, move cursor to row #
+        // convert from 1-based to 0-based
+        row = ParamOrDefault(0, 1) - 1;
+        clamp_row();
+        break;
+    case dispatch_key('?', 0, 'h'):
+        // CSI ? Pm h, DEC Private Mode Set (DECSET)
+        for (int i = 0; i < num_params; i++) {
+            if (params[i] == 1) {
+                // CSI ? 1 h, Application Cursor Keys (DECCKM)
+                // TODO
+            } else if (params[i] == 12) {
+                // CSI ? 12 h, Start blinking cursor
+                // TODO
+            } else if (params[i] == 25) {
+                // CSI ? 25 h, DECTCEM, make cursor visible
+                show_cursor = true;
+            } else if (params[i] == 47 || params[i] == 1047) {
+                // CSI ? 47 h, CSI ? 1047 h, use alternate screen buffer
+                SwitchScreen(true);
+            } else if (params[i] == 1049) {
+                // CSI ? 1049 h, save cursor as in DECSC and use alternate screen buffer, clearing it first
+                SaveCursor();
+                SwitchScreen(true);
+                for (int i = 0; i < term_row; i++) {
+                    std::fill(terminal[i].begin(), terminal[i].end(), term_char());
+                    terminal.SetWrapped(i, false);
+                }
+            } else if (params[i] == 1000) {
+                // CSI ? 1000 h, Send Mouse X & Y on button press and release
+                // TODO
+            } else if (params[i] == 1002) {
+                // CSI ? 1002 h, Use Cell Motion Mouse Tracking
+                // TODO
+            } else if (params[i] == 1006) {
+                // CSI ? 1006 h, Enable SGR Mouse Mode
+                // TODO
+            } else if (params[i] == 2004) {
+                // CSI ? 2004 h, set bracketed paste mode
+                // TODO
+            } else if (params[i] == 2026) {
+                // CSI ? 2026 h, begin synchronized update
+                if (!synchronized_output) {
+                    synchronized_output = true;
+                    synchronized_output_msec = NowMsec();
+                }
+            } else {
+                TraceEvent(trace_unknown_decset, params[i], 0);
+            }
+        }
+        break;
+    case dispatch_key('?', 0, 'l'):
+        // CSI ? Pm l, DEC Private Mode Reset (DECRST)
+        for (int i = 0; i < num_params; i++) {
+            if (params[i] == 12) {
+                // CSI ? 12 l, Stop blinking cursor
+                // TODO
+            } else if (params[i] == 25) {
+                // CSI ? 25 l, Hide cursor (DECTCEM)
+                show_cursor = false;
+            } else if (params[i] == 47) {
+                // CSI ? 47 l, use normal screen buffer
+                SwitchScreen(false);
+            } else if (params[i] == 1047) {
+                // CSI ? 1047 l, use normal screen buffer, clearing the alternate screen first
+                if (alternate_screen) {
+                    for (int i = 0; i < term_row; i++) {
+                        std::fill(terminal[i].begin(), terminal[i].end(), term_char());
+                        terminal.SetWrapped(i, false);
+                    }
+                }
+                SwitchScreen(false);
+            } else if (params[i] == 1049) {
+                // CSI ? 1049 l, use normal screen buffer and restore cursor as in DECRC
+                SwitchScreen(false);
+                RestoreCursor();
+            } else if (params[i] == 2004) {
+                // CSI ? 2004 l, reset bracketed paste mode
+                // TODO
+            } else if (params[i] == 2026) {
+                // CSI ? 2026 l, end synchronized update
+                synchronized_output = false;
+            } else {
+                TraceEvent(trace_unknown_decrst, params[i], 0);
+            }
+        }
+        break;
+    case dispatch_key('?', '$', 'p'): {
+        // CSI ? Ps $ p, DECRQM, Request DEC Private Mode
+        // send CSI ? Ps ; Pm $ y, Pm = 1: set, 2: reset, 0: not recognized
+        // applications probe for synchronized output this way before using it
+        int mode = Param(0);
+        int value = 0;
+        if (mode == 25) {
+            value = show_cursor ? 1 : 2;
+        } else if (mode == 47 || mode == 1047 || mode == 1049) {
+            value = alternate_screen ? 1 : 2;
+        } else if (mode == 2026) {
+            value = synchronized_output ? 1 : 2;
+        }
+        char send_buffer[128] = {};
+        snprintf(send_buffer, sizeof(send_buffer), "\x1b[?%d;%d$y", mode, value);
+        QueueWrite((uint8_t *)send_buffer, strlen(send_buffer));
+        break;
+    }
+    case dispatch_key(0, 0, 'm'):
+        // CSI Pm m, Character Attributes (SGR)
+        SelectGraphicRendition();
+        break;
+    case dispatch_key('>', 0, 'm'):
+        // CSI > Pp m, XTMODKEYS, set/reset key modifier options
+        // TODO
+        break;
+    case dispatch_key(0, 0, 'n'):
+        // CSI Ps n, DSR, Device Status Report
+        if (Param(0) == 6) {
+            // Ps = 6: Report Cursor Position (CPR)
+            // send ESC [ row ; col R
+            char send_buffer[128] = {};
+            snprintf(send_buffer, sizeof(send_buffer), "\x1b[%d;%dR", row + 1, col + 1);
+            QueueWrite((uint8_t *)send_buffer, strlen(send_buffer));
+        }
+        break;
+    case dispatch_key(0, 0, 's'):
+        // CSI s, SCOSC, Save cursor, same as DECSC
+        SaveCursor();
+        break;
+    case dispatch_key(0, 0, 'u'):
+        // CSI u, SCORC, Restore cursor, same as DECRC
+        RestoreCursor();
+        break;
+    case dispatch_key(0, 0, 'r'): {
+        // CSI Ps ; Ps r, DECSTBM, set scrolling region [top;bottom], default to the whole screen
+        int top = ParamOrDefault(0, 1) - 1;
+        int bottom = std::min(ParamOrDefault(1, term_row), term_row) - 1;
+        if (top < bottom) {
+            scroll_top = top;
+            scroll_bottom = bottom;
+            // and move the cursor home
+            row = 0;
+            col = 0;
+        }
+        break;
+    }
+    case dispatch_key(0, 0, 'L'):
+        // CSI Ps L, IL, insert Ps blank lines at the cursor, pushing the rows below down the scroll region
+        if (row >= scroll_top && row <= scroll_bottom) {
+            terminal.ScrollDown(row, scroll_bottom, ParamOrDefault(0, 1));
+            col = 0;
+        }
+        break;
+    case dispatch_key(0, 0, 'M'):
+        // CSI Ps M, DL, delete Ps lines at the cursor, pulling the rows below up the scroll region
+        if (row >= scroll_top && row <= scroll_bottom) {
+            terminal.ScrollUp(row, scroll_bottom, ParamOrDefault(0, 1));
+            col = 0;
+        }
+        break;
+    case dispatch_key(0, 0, 'S'): {
+        // CSI Ps S, SU, scroll up Ps lines
+        int count = std::min(ParamOrDefault(0, 1), scroll_bottom - scroll_top + 1);
+        if (scroll_top == 0 && scroll_bottom == term_row - 1 && !alternate_screen) {
+            // as with line feeds at the bottom, rows scrolled off the main screen go to history
+            for (int i = 0; i < count; i++) {
+                history->Push(terminal.Row(i).data(), term_col, terminal.Wrapped(i));
+            }
+        }
+        terminal.ScrollUp(scroll_top, scroll_bottom, count);
+        break;
+    }
+    case dispatch_key(0, 0, 'T'):
+        // CSI Ps T, SD, scroll down Ps lines
+        // with more parameters it is mouse highlight tracking, which is not supported
+        if (num_params <= 1) {
+            terminal.ScrollDown(scroll_top, scroll_bottom, ParamOrDefault(0, 1));
+        }
+        break;
+    case dispatch_key(0, 0, '@'): {
+        // CSI Ps @, ICH, Insert Ps (Blank) Character(s)
+        int count = ParamOrDefault(0, 1);
+        for (int i = term_col - 1; i >= col; i--) {
+            if (i - col < count) {
+                terminal[row][i] = term_char();
+            } else {
+                terminal[row][i] = terminal[row][i - count];
+            }
+        }
+        break;
+    }
+    default:
+        // unknown
+        TraceEvent(trace_unknown_csi, key >> 8, final);
+        break;
+    }
+}
+
+void term_session::ParseOutput(const uint8_t *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        // fast path: runs of printable ascii in ground state
+        if (escape_state == state_ground && utf8_state == state_initial) {
+            size_t run = ScanPrintable(buffer + i, length - i);
+            if (run > 0) {
+                InsertPrintable(buffer + i, run);
+                i += run;
+                if (i == length) {
+                    break;
+                }
+            }
+        }
+
+        uint8_t byte = buffer[i];
+
+        // a partial utf8 sequence interrupted by a non-continuation byte is dropped
+        if (utf8_state != state_initial) {
+            if (byte >= 0x80 && byte <= 0xbf) {
+                DecodeUtf8(byte);
+                continue;
+            }
+            utf8_state = state_initial;
+        }
+
+        uint8_t entry = parser_table[escape_state][byte];
+        switch (entry >> 4) {
+        case action_print:
+            DecodeUtf8(byte);
+            break;
+        case action_execute:
+            Execute(byte);
+            break;
+        case action_collect:
+            Collect(byte);
+            break;
+        case action_param:
+            CollectParam(byte);
+            break;
+        case action_esc_dispatch:
+            EscDispatch(byte);
+            break;
+        case action_csi_dispatch:
+            CsiDispatch(byte);
+            break;
+        default:
+            break;
+        }
+
+        escape_states next = (escape_states)(entry & 0xf);
+        if (next != state_stay) {
+            escape_state = next;
+            if (next == state_esc || next == state_csi_entry || next == state_dcs_entry) {
+                Clear();
+            }
+        }
+    }
+}
+
+// a cell erased or never written
+static bool IsBlank(const term_char &c) {
+    return c.ch == ' ' && c.style.bg == color_default_bg && c.style.attrs == 0;
+}
+
+// rewrap the soft-wrapped rows of screen to term_row x term_col, the cursor is moved along
+// for the main screen only, rows that do not fit go to history, and rows left free are filled from history
+void term_session::ReflowScreen(term_screen &screen, int &cursor_row, int &cursor_col) {
+    int old_rows = screen.size();
+    int old_cols = old_rows > 0 ? screen.Row(0).size() : 0;
+    if (old_rows == term_row && old_cols == term_col) {
+        return;
+    }
+    // the last row to keep: the cursor row or the last row with text, whichever is lower
+    int last_row = std::min(cursor_row, old_rows - 1);
+    for (int i = old_rows - 1; i > last_row; i--) {
+        const std::vector<term_char> &r = screen.Row(i);
+        if (!std::all_of(r.begin(), r.end(), IsBlank)) {
+            last_row = i;
+            break;
+        }
+    }
+
+    // join rows into lines where they wrapped, the cursor is kept as an offset into its line
+    std::deque<std::vector<term_char>> lines(1);
+    size_t cursor_line = 0;
+    int cursor_offset = 0;
+    for (int i = 0; i <= last_row; i++) {
+        const std::vector<term_char> &r = screen.Row(i);
+        std::vector<term_char> &line = lines.back();
+        if (i == cursor_row) {
+            cursor_line = lines.size() - 1;
+            cursor_offset = line.size() + cursor_col;
+        }
+        if (screen.Wrapped(i) && i < last_row) {
+            line.insert(line.end(), r.begin(), r.end());
+        } else {
+            // trailing blanks are not part of the line, so that they do not wrap into a row of their own
+            int length = r.size();
+            while (length > 0 && IsBlank(r[length - 1])) {
+                length--;
+            }
+            line.insert(line.end(), r.begin(), r.begin() + length);
+            if (i < last_row) {
+                lines.emplace_back();
+            }
+        }
+    }
+
+    // a line wrapped from history into the screen is taken back whole, so that it is rewrapped in one piece
+    std::vector<term_char> taken;
+    if (history->LastWrapped() && history->PopLine(taken)) {
+        lines.front().insert(lines.front().begin(), taken.begin(), taken.end());
+        if (cursor_line == 0) {
+            cursor_offset += taken.size();
+        }
+    }
+    history->SetWidth(term_col);
+
+    // rows each line takes at the new width, an empty line still takes one
+    auto line_rows = [&](size_t i) {
+        int num_rows = std::max(1, ((int)lines[i].size() + term_col - 1) / term_col);
+        if (i == cursor_line) {
+            num_rows = std::max(num_rows, cursor_offset / term_col + 1);
+        }
+        return num_rows;
+    };
+    int total_rows = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        total_rows += line_rows(i);
+    }
+    // rows left free at the top are filled with lines taken back from history
+    while (total_rows < term_row) {
+        taken.clear();
+        if (!history->PopLine(taken)) {
+            break;
+        }
+        lines.push_front(std::move(taken));
+        cursor_line++;
+        total_rows += line_rows(0);
+    }
+
+    // wrap the lines again at the new width
+    std::vector<std::vector<term_char>> rows;
+    std::vector<bool> wrapped;
+    int new_row = 0;
+    int new_col = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        const std::vector<term_char> &line = lines[i];
+        int num_rows = line_rows(i);
+        if (i == cursor_line) {
+            new_row = rows.size() + cursor_offset / term_col;
+            new_col = cursor_offset % term_col;
+        }
+        for (int j = 0; j < num_rows; j++) {
+            rows.emplace_back(term_col);
+            size_t begin = std::min(line.size(), (size_t)j * term_col);
+            size_t end = std::min(line.size(), begin + term_col);
+            std::copy(line.begin() + begin, line.begin() + end, rows.back().begin());
+            wrapped.push_back(j < num_rows - 1);
+        }
+    }
+
+    // rows that do not fit go to history from the top, but the cursor stays on screen
+    int excess = std::max(0, (int)rows.size() - term_row);
+    int pushed_rows = std::min(excess, new_row);
+    for (int i = 0; i < pushed_rows; i++) {
+        history->Push(rows[i].data(), term_col, wrapped[i]);
+    }
+    rows.erase(rows.begin(), rows.begin() + pushed_rows);
+    wrapped.erase(wrapped.begin(), wrapped.begin() + pushed_rows);
+    // and rows below the cursor that still do not fit are cut off
+    rows.resize(std::min((int)rows.size(), term_row));
+    wrapped.resize(rows.size());
+    screen.Assign(rows, wrapped, term_row, term_col);
+
+    cursor_row = std::min(new_row - pushed_rows, term_row - 1);
+    cursor_col = std::min(new_col, term_col - 1);
+}
+
+void term_session::ResizeTerminal() {
+    scroll_top = 0;
+    scroll_bottom = term_row - 1;
+    if (!alternate_screen) {
+        ReflowScreen(terminal, row, col);
+        other_screen.Resize(term_row, term_col);
+    } else {
+        // full-screen applications redraw the alternate screen on SIGWINCH, so it is not reflowed,
+        // the main screen is, with the cursor that mode 1049 restores when switching back to it
+        ReflowScreen(other_screen, saved_cursors[0].row, saved_cursors[0].col);
+        terminal.Resize(term_row, term_col);
+        row = std::min(row, term_row - 1);
+        col = std::min(col, term_col - 1);
+    }
+}
+
+int term_session::SynchronizedOutputTimeLeft() const {
+    uint64_t elapsed = NowMsec() - synchronized_output_msec;
+    return elapsed < SYNCHRONIZED_OUTPUT_TIMEOUT_MSEC ? SYNCHRONIZED_OUTPUT_TIMEOUT_MSEC - (int)elapsed : 0;
+}
+
+// or'ed into ready_snapshot until the renderer takes it
+#define SNAPSHOT_FRESH 4
+
+bool term_session::PublishSnapshot() {
+    // hold the update back until the application ends it, or gives up on it
+    if (synchronized_output) {
+        if (NowMsec() - synchronized_output_msec < SYNCHRONIZED_OUTPUT_TIMEOUT_MSEC) {
+            return false;
+        }
+        // timed out, the mode counts as reset, so that the terminal worker stops waking up for it
+        // until the application sets it again
+        synchronized_output = false;
+    }
+    if (terminal.last_generation == published_generation && row == published_row && col == published_col &&
+        show_cursor == published_show_cursor && history->size() == published_history_size) {
+        return false;
+    }
+    published_generation = terminal.last_generation;
+    published_row = row;
+    published_col = col;
+    published_show_cursor = show_cursor;
+    published_history_size = history->size();
+
+    term_snapshot &snapshot = snapshots[back_snapshot];
+    if (snapshot.rows.size() != terminal.rows.size()) {
+        snapshot.rows.resize(terminal.rows.size());
+        // generations start at 1, so all rows are copied
+        snapshot.generation.assign(terminal.rows.size(), 0);
+    }
+    // rows changed since this snapshot was last published, at most two publications ago
+    for (size_t i = 0; i < terminal.rows.size(); i++) {
+        if (snapshot.generation[i] != terminal.generation[i]) {
+            snapshot.rows[i] = terminal.rows[i];
+            snapshot.generation[i] = terminal.generation[i];
+        }
+    }
+    snapshot.head = terminal.head;
+    snapshot.last_generation = terminal.last_generation;
+    snapshot.row = row;
+    snapshot.col = col;
+    snapshot.show_cursor = show_cursor;
+    snapshot.history_pushed = history->pushed;
+    snapshot.history_layout = history->layout;
+
+    back_snapshot = ready_snapshot.exchange(back_snapshot | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+    return true;
+}
+
+const term_snapshot &term_session::AcquireSnapshot() {
+    if (ready_snapshot.load() & SNAPSHOT_FRESH) {
+        front_snapshot = ready_snapshot.exchange(front_snapshot) & ~SNAPSHOT_FRESH;
+    }
+    return snapshots[front_snapshot];
+}
+
+void term_session::QueueWrite(const uint8_t *data, size_t length) {
+    pthread_mutex_lock(&write_queue_lock);
+    write_queue.insert(write_queue.end(), data, data + length);
+    pthread_mutex_unlock(&write_queue_lock);
+}
+
+size_t term_session::FlushWriteQueue(uint64_t *writes) {
+    pthread_mutex_lock(&write_queue_lock);
+    // everything queued so far goes out in one write, so keystrokes sent in quick succession coalesce
+    while (write_queue_head < write_queue.size()) {
+        ssize_t res = write(fd, write_queue.data() + write_queue_head, write_queue.size() - write_queue_head);
+        if (writes) {
+            (*writes)++;
+        }
+        if (res > 0) {
+            write_queue_head += res;
+        } else if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // the application is gone, nobody is going to read this
+            write_queue_head = write_queue.size();
+        } else {
+            // the pty is full, retry when it becomes writable
+            break;
+        }
+    }
+    if (write_queue_head == write_queue.size()) {
+        write_queue.clear();
+        write_queue_head = 0;
+    } else if (write_queue_head > write_queue.size() / 2) {
+        // drop the written part once it dominates, so a long paste is not copied on every partial write
+        write_queue.erase(write_queue.begin(), write_queue.begin() + write_queue_head);
+        write_queue_head = 0;
+    }
+    size_t left = write_queue.size() - write_queue_head;
+    pthread_mutex_unlock(&write_queue_lock);
+    return left;
+}
+
+size_t term_session::WriteQueueSize() {
+    pthread_mutex_lock(&write_queue_lock);
+    size_t left = write_queue.size() - write_queue_head;
+    pthread_mutex_unlock(&write_queue_lock);
+    return left;
+}
@@ -0,0 +1,426 @@
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <pthread.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+
+// terminal emulation: escape sequence parser, utf8 decoder and the character grid
+// no dependency on napi, hilog or egl, so that it can be built and benchmarked on plain linux
+
+struct term_history;
+
+enum weight {
+    regular = 0,
+    bold = 1,
+    NUM_WEIGHT,
+};
+
+// color index stored in a cell
+// 0-255 are the xterm 256 color palette, followed by the default colors and truecolor entries
+// truecolor entries are allocated on use by each session, and reused once none of its cells refer to them
+enum colors {
+    color_default_fg = 256,
+    color_default_bg = 257,
+    color_truecolor_base = 258,
+    NUM_COLORS = 4096,
+};
+
+// rgb of the palette and default colors, colors are only resolved to floats at render time
+extern float color_table[color_truecolor_base][3];
+
+// set of color indices, e.g. those some cells refer to
+typedef std::bitset<NUM_COLORS> color_set;
+
+enum attributes {
+    attr_bold = 1 << 0,
+};
+
+// maintain terminal status, packed into 4 bytes
+struct style {
+    // color index of foreground
+    uint32_t fg : 12;
+    // color index of background
+    uint32_t bg : 12;
+    // bitmask of attributes
+    uint32_t attrs : 8;
+
+    style() : fg(color_default_fg), bg(color_default_bg), attrs(0) {}
+
+    enum weight Weight() const { return (attrs & attr_bold) ? bold : regular; }
+};
+// 8 bytes per cell, including history
+struct term_char {
+    uint32_t ch = ' ';
+    struct style style;
+};
+static_assert(sizeof(term_char) == 8, "term_char should be packed into 8 bytes");
+
+// rows of the screen, stored in a ring
+// scrolling the whole screen up by one line only rotates head, the rows themselves are not moved
+struct term_screen {
+    std::vector<std::vector<term_char>> rows;
+    // index into rows of the first (top) row on screen
+    int head = 0;
+    // indexed like rows, changes whenever the content of a row may have changed
+    // rotating does not change content, so the renderer can keep per-row caches across scrolling
+    std::vector<uint64_t> generation;
+    // the latest generation of any row, compare to tell if anything changed
+    uint64_t last_generation = 0;
+    // indexed like rows, set if the row was filled to the last column and the text went on in the next row
+    // so that resizing can rewrap the text, it does not change how the row is drawn
+    std::vector<bool> wrapped;
+
+    int size() const { return rows.size(); }
+
+    // for writing, bumps the generation of the row
+    std::vector<term_char> &operator[](int i) {
+        int index = RingIndex(i);
+        generation[index] = ++last_generation;
+        return rows[index];
+    }
+
+    // for reading, e.g. by the renderer
+    const std::vector<term_char> &Row(int i) const { return rows[RingIndex(i)]; }
+
+    // index into rows of screen row i
+    int RingIndex(int i) const {
+        int index = head + i;
+        if (index >= (int)rows.size()) {
+            index -= rows.size();
+        }
+        return index;
+    }
+
+    // the top row becomes the bottom row, with its storage reused
+    void RotateUp() {
+        head++;
+        if (head == (int)rows.size()) {
+            head = 0;
+        }
+    }
+
+    // scroll rows top to bottom (inclusive) up by count, the rows scrolled out come back blank at the bottom
+    // rows are rotated in the ring, no cell is copied. the whole screen rotates head, otherwise the rows
+    // swap places and count as changed, as the renderer caches rows by their index in the ring
+    void ScrollUp(int top, int bottom, int count) {
+        count = std::min(count, bottom - top + 1);
+        if (top == 0 && bottom == size() - 1) {
+            head = RingIndex(count);
+        } else {
+            // the row at bottom no longer continues in the row below
+            SetWrapped(bottom, false);
+            RotateRows(top, top + count, bottom + 1);
+        }
+        BlankRows(bottom - count + 1, bottom);
+        if (top > 0) {
+            SetWrapped(top - 1, false);
+        }
+    }
+
+    // scroll rows top to bottom (inclusive) down by count, the rows scrolled out come back blank at the top
+    void ScrollDown(int top, int bottom, int count) {
+        count = std::min(count, bottom - top + 1);
+        if (top == 0 && bottom == size() - 1) {
+            head = RingIndex(size() - count);
+        } else {
+            RotateRows(top, bottom + 1 - count, bottom + 1);
+        }
+        BlankRows(top, top + count - 1);
+        SetWrapped(bottom, false);
+        if (top > 0) {
+            SetWrapped(top - 1, false);
+        }
+    }
+
+    // change to new_rows x new_cols, keeping rows from the top
+    void Resize(int new_rows, int new_cols) {
+        std::rotate(rows.begin(), rows.begin() + head, rows.end());
+        std::rotate(wrapped.begin(), wrapped.begin() + head, wrapped.end());
+        head = 0;
+        rows.resize(new_rows);
+        for (auto &r : rows) {
+            r.resize(new_cols);
+        }
+        wrapped.resize(new_rows);
+        generation.resize(new_rows);
+        TouchAll();
+    }
+
+    bool Wrapped(int i) const { return wrapped[RingIndex(i)]; }
+    void SetWrapped(int i, bool value) { wrapped[RingIndex(i)] = value; }
+
+    // take new_rows from the top, padded with blank rows to num_rows x num_cols
+    void Assign(std::vector<std::vector<term_char>> &new_rows, std::vector<bool> &new_wrapped, int num_rows,
+                int num_cols) {
+        rows.swap(new_rows);
+        wrapped.swap(new_wrapped);
+        head = 0;
+        rows.resize(num_rows, std::vector<term_char>(num_cols));
+        wrapped.resize(num_rows);
+        generation.resize(num_rows);
+        TouchAll();
+    }
+
+    // all rows count as changed, e.g. when they moved
+    void TouchAll() {
+        for (auto &g : generation) {
+            g = ++last_generation;
+        }
+    }
+
+  private:
+    // rotate rows first to last (exclusive) so that middle becomes first, as std::rotate, by swapping vectors
+    // with three reversals, so that it works across the end of the ring
+    void RotateRows(int first, int middle, int last) {
+        ReverseRows(first, middle);
+        ReverseRows(middle, last);
+        ReverseRows(first, last);
+        for (int i = first; i < last; i++) {
+            generation[RingIndex(i)] = ++last_generation;
+        }
+    }
+
+    void ReverseRows(int first, int last) {
+        for (last--; first < last; first++, last--) {
+            int a = RingIndex(first);
+            int b = RingIndex(last);
+            rows[a].swap(rows[b]);
+            bool w = wrapped[a];
+            wrapped[a] = wrapped[b];
+            wrapped[b] = w;
+        }
+    }
+
+    void BlankRows(int first, int last) {
+        for (int i = first; i <= last; i++) {
+            std::fill((*this)[i].begin(), (*this)[i].end(), term_char());
+            SetWrapped(i, false);
+        }
+    }
+};
+
+// what the renderer needs to know of the terminal, copied out by the parser thread
+// three snapshots are handed around with atomic exchanges, so that neither thread waits for the other:
+// the parser fills its back snapshot and swaps it with the ready one, the renderer swaps its front snapshot
+// with the ready one if that is newer. each snapshot keeps its rows, so only rows changed since are copied.
+struct term_snapshot {
+    // rows, generation and head as in term_screen
+    std::vector<std::vector<term_char>> rows;
+    std::vector<uint64_t> generation;
+    int head = 0;
+    uint64_t last_generation = 0;
+    int row = 0;
+    int col = 0;
+    bool show_cursor = false;
+    // history.pushed and history.layout at the time
+    // the number of history rows is asked from history itself, as rewrapping them when drawn may change it
+    uint64_t history_pushed = 0;
+    uint64_t history_layout = 0;
+
+    int size() const { return rows.size(); }
+
+    int RingIndex(int i) const {
+        int index = head + i;
+        if (index >= (int)rows.size()) {
+            index -= rows.size();
+        }
+        return index;
+    }
+};
+
+// states of the dec ansi parser
+enum escape_states {
+    state_ground,
+    state_esc,
+    state_esc_intermediate,
+    state_csi_entry,
+    state_csi_param,
+    state_csi_intermediate,
+    state_csi_ignore,
+    state_osc_string,
+    state_dcs_entry,
+    state_dcs_param,
+    state_dcs_intermediate,
+    state_dcs_passthrough,
+    state_dcs_ignore,
+    state_sos_pm_apc_string,
+    NUM_ESCAPE_STATES,
+    // keep the current state, do not run entry actions
+    state_stay = 0xf,
+};
+
+enum utf8_states {
+    state_initial,
+    state_2byte_2,        // expected 2nd byte of 2-byte sequence
+    state_3byte_2_e0,     // expected 2nd byte of 3-byte sequence starting with 0xe0
+    state_3byte_2_non_e0, // expected 2nd byte of 3-byte sequence starting with non-0xe0
+    state_3byte_3,        // expected 3rd byte of 3-byte sequence
+    state_4byte_2_f0,     // expected 2nd byte of 4-byte sequence starting with 0xf0
+    state_4byte_2_f1_f3,  // expected 2nd byte of 4-byte sequence starting with 0xf1 to 0xf3
+    state_4byte_2_f4,     // expected 2nd byte of 4-byte sequence starting with 0xf4
+    state_4byte_3,        // expected 3rd byte of 4-byte sequence
+    state_4byte_4,        // expected 4th byte of 4-byte sequence
+};
+
+// parameters and intermediate bytes of the current escape sequence
+// fixed size, so nothing is allocated while parsing
+#define MAX_PARAMS 16
+#define MAX_INTERMEDIATES 2
+#define MAX_PARAM_VALUE 65535
+
+// longest time an update is held back by DEC mode 2026, in case the application never ends it
+#define SYNCHRONIZED_OUTPUT_TIMEOUT_MSEC 150
+
+// truecolors that fall back to the color cube before unused entries are looked for again, after none were found
+#define TRUECOLOR_RECLAIM_INTERVAL 256
+
+// one terminal: a pty, the grid and scrollback, and the parser state
+// there can be any number of sessions, the palette, glyphs and threads are shared by all of them
+struct term_session {
+    // pty master, input and replies to the application (e.g. device attributes) are written here
+    int fd = -1;
+
+    // protects the terminal while the parser or the ui thread change it
+    // the render worker never takes it, it draws from snapshots published with PublishSnapshot
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // the screen shown, the main or the alternate one
+    term_screen terminal;
+    std::unique_ptr<term_history> history;
+    // cursor position
+    int row = 0;
+    int col = 0;
+    bool show_cursor = true;
+    // DEC mode 2026, while set PublishSnapshot holds back the screen so that half-done updates are never drawn
+    // PublishSnapshot resets it after SYNCHRONIZED_OUTPUT_TIMEOUT_MSEC, in case the application never does
+    bool synchronized_output = false;
+    // terminal size in characters
+    int term_col = 80;
+    int term_row = 24;
+    // scroll region set by DECSTBM, first and last row (inclusive), reset to the whole screen on resize
+    int scroll_top = 0;
+    int scroll_bottom = term_row - 1;
+
+    term_session();
+    ~term_session();
+
+    // resize the grid to term_row x term_col, rewrapping soft-wrapped rows to the new width
+    // rows that no longer fit above the cursor go to history, which rewraps its own lines lazily
+    // rows left free are filled with the last lines of history, taken back from it
+    // the alternate screen is only resized, its application redraws it
+    void ResizeTerminal();
+
+    // feed bytes read from the pty into the parser
+    // the caller is responsible for locking
+    void ParseOutput(const uint8_t *buffer, size_t length);
+
+    // queue bytes for the application, never blocks, thread safe
+    // the io thread writes them with FlushWriteQueue when the pty accepts them
+    void QueueWrite(const uint8_t *data, size_t length);
+    // write as much of the queue as the pty takes without blocking, returns the number of bytes still queued
+    // adds the number of write calls to *writes if given
+    size_t FlushWriteQueue(uint64_t *writes = nullptr);
+    // number of bytes queued
+    size_t WriteQueueSize();
+
+    // publish the current state if anything changed since the last call, returns true if so
+    // nothing is published during a synchronized update, until it ends or times out
+    // parser thread only, with the terminal locked
+    bool PublishSnapshot();
+    // milliseconds until a synchronized update times out and PublishSnapshot gives up holding it back
+    int SynchronizedOutputTimeLeft() const;
+    // the latest published snapshot, valid until the next call
+    // render thread only, never blocks
+    const term_snapshot &AcquireSnapshot();
+
+    // rgb of a color index, from any thread
+    // a truecolor entry is only reused once no snapshot or history line refers to it
+    const float *Color(int index) const {
+        return index < color_truecolor_base ? color_table[index] : truecolor_table[index - color_truecolor_base];
+    }
+
+  private:
+    escape_states escape_state = state_ground;
+    int params[MAX_PARAMS];
+    int num_params = 0;
+    // bit i is set when params[i] follows a ':', a sub-parameter of the one before
+    uint16_t sub_params = 0;
+    // more than MAX_PARAMS parameters, the rest is dropped
+    bool params_overflow = false;
+    uint8_t intermediates[MAX_INTERMEDIATES];
+    int num_intermediates = 0;
+    // too many intermediates, ignore the sequence
+    bool intermediates_overflow = false;
+    utf8_states utf8_state = state_initial;
+    uint32_t current_utf8 = 0;
+    style current_style;
+    // truecolor entries of this session, see colors
+    float truecolor_table[NUM_COLORS - color_truecolor_base][3];
+    // rgb to allocated color index
+    std::unordered_map<uint32_t, int> truecolors;
+    // entries not in use, all of them at first, refilled by ReclaimTrueColors
+    std::vector<int> free_truecolors;
+    // truecolors that fell back to the color cube since a reclaim last found nothing to free
+    int truecolor_fallbacks = 0;
+    // when DEC mode 2026 was last set
+    uint64_t synchronized_output_msec = 0;
+
+    // the screen not shown, swapped with terminal when switching
+    // full-screen applications draw to the alternate screen, so their output never scrolls into history
+    term_screen other_screen;
+    bool alternate_screen = false;
+    // DECSC, restored by DECRC, one for each screen, indexed by alternate_screen
+    struct saved_cursor {
+        int row = 0;
+        int col = 0;
+        struct style style;
+    } saved_cursors[2];
+
+    // bytes waiting for the pty to accept them, write_queue_head of them are already written
+    pthread_mutex_t write_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<uint8_t> write_queue;
+    size_t write_queue_head = 0;
+
+    term_snapshot snapshots[3];
+    // index of the ready snapshot, or'ed with SNAPSHOT_FRESH until the renderer takes it
+    std::atomic<int> ready_snapshot{2};
+    // owned by the parser and the renderer
+    int back_snapshot = 0;
+    int front_snapshot = 1;
+    // state of the last published snapshot
+    uint64_t published_generation = 0;
+    int published_row = -1;
+    int published_col = -1;
+    bool published_show_cursor = false;
+    int published_history_size = -1;
+
+    void DropFirstRowIfOverflow();
+    void ReflowScreen(term_screen &screen, int &cursor_row, int &cursor_col);
+    void SwitchScreen(bool alternate);
+    void SaveCursor();
+    void RestoreCursor();
+    int ParamOrDefault(int i, int def);
+    int Param(int i);
+    void InsertUtf8(uint32_t codepoint);
+    void InsertPrintable(const uint8_t *data, size_t count);
+    void DecodeUtf8(uint8_t byte);
+    void Execute(uint8_t byte);
+    void Collect(uint8_t byte);
+    void CollectParam(uint8_t byte);
+    void Clear();
+    void EscDispatch(uint8_t final);
+    int TrueColor(int red, int green, int blue);
+    void ReclaimTrueColors();
+    int ExtendedColor(int &i);
+    void SelectGraphicRendition();
+    void CsiDispatch(uint8_t final);
+};
+
+#endif
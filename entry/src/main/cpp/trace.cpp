@@ -0,0 +1,150 @@
+#include "trace.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define TRACE_RECORDS 4096
+#define TRACE_BYTES (1024 * 1024)
+
+std::atomic<bool> trace_enabled(false);
+
+// each slot is committed by storing seq = index + 1 last
+// the dump skips slots that are being written or have been overwritten
+struct trace_record {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> time_nsec;
+    std::atomic<uint32_t> event;
+    std::atomic<uint32_t> arg0;
+    std::atomic<uint64_t> arg1;
+};
+static trace_record records[TRACE_RECORDS];
+static std::atomic<uint64_t> record_pos(0);
+
+// raw pty bytes, referenced by trace_pty_read records
+static uint8_t bytes[TRACE_BYTES];
+static std::atomic<uint64_t> byte_pos(0);
+
+static uint64_t NowNsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void TraceEventSlow(trace_events event, uint32_t arg0, uint64_t arg1) {
+    uint64_t index = record_pos.fetch_add(1, std::memory_order_relaxed);
+    trace_record &record = records[index % TRACE_RECORDS];
+    record.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.time_nsec.store(NowNsec(), std::memory_order_relaxed);
+    record.event.store(event, std::memory_order_relaxed);
+    record.arg0.store(arg0, std::memory_order_relaxed);
+    record.arg1.store(arg1, std::memory_order_relaxed);
+    record.seq.store(index + 1, std::memory_order_release);
+}
+
+void TraceBytesSlow(const uint8_t *data, size_t length) {
+    uint64_t pos = byte_pos.fetch_add(length, std::memory_order_relaxed);
+    // only the tail fits if the read is larger than the ring
+    size_t skip = length > TRACE_BYTES ? length - TRACE_BYTES : 0;
+    for (size_t i = skip; i < length;) {
+        size_t off = (pos + i) % TRACE_BYTES;
+        size_t n = std::min(length - i, (size_t)TRACE_BYTES - off);
+        memcpy(&bytes[off], data + i, n);
+        i += n;
+    }
+    TraceEventSlow(trace_pty_read, length, pos);
+}
+
+void SetTraceEnabled(bool enabled) { trace_enabled.store(enabled, std::memory_order_relaxed); }
+
+static const char *event_names[NUM_TRACE_EVENTS] = {
+    "pty read",       "unknown esc",   "unknown csi", "unknown sgr", "unknown decset",
+    "unknown decrst", "missing glyph", "font loaded", "frame stats", "frames skipped",
+    "atlas grow",     "atlas evict",   "pty stats",   "write stats", "ring stats",
+};
+
+// escape non-printable bytes like \x1b
+static void AppendEscaped(std::string &out, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] >= 127 || data[i] < 32) {
+            char temp[8];
+            snprintf(temp, sizeof(temp), "\\x%02x", data[i]);
+            out += temp;
+        } else {
+            out += (char)data[i];
+        }
+    }
+}
+
+void TraceDump(int out_fd) {
+    uint64_t end = record_pos.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_RECORDS ? end - TRACE_RECORDS : 0;
+    std::string out;
+    std::vector<uint8_t> data;
+    for (uint64_t index = begin; index < end; index++) {
+        trace_record &record = records[index % TRACE_RECORDS];
+        if (record.seq.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        uint64_t time_nsec = record.time_nsec.load(std::memory_order_relaxed);
+        uint32_t event = record.event.load(std::memory_order_relaxed);
+        uint32_t arg0 = record.arg0.load(std::memory_order_relaxed);
+        uint64_t arg1 = record.arg1.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.seq.load(std::memory_order_relaxed) != index + 1 || event >= NUM_TRACE_EVENTS) {
+            // overwritten while reading
+            continue;
+        }
+
+        char line[128];
+        snprintf(line, sizeof(line), "[%llu.%06llu] %s: ", (unsigned long long)(time_nsec / 1000000000),
+                 (unsigned long long)(time_nsec % 1000000000 / 1000), event_names[event]);
+        out += line;
+
+        if (event == trace_pty_read) {
+            // arg0 is length, arg1 is the position in the byte ring
+            // bytes are overwritten once the ring has advanced a full lap past them
+            if (arg0 > TRACE_BYTES || byte_pos.load(std::memory_order_acquire) > arg1 + TRACE_BYTES) {
+                snprintf(line, sizeof(line), "%u bytes, dropped from ring", arg0);
+                out += line;
+            } else {
+                data.resize(arg0);
+                for (size_t i = 0; i < arg0; i++) {
+                    data[i] = bytes[(arg1 + i) % TRACE_BYTES];
+                }
+                // check again in case the writer lapped us while copying
+                if (byte_pos.load(std::memory_order_acquire) > arg1 + TRACE_BYTES) {
+                    snprintf(line, sizeof(line), "%u bytes, dropped from ring", arg0);
+                    out += line;
+                } else {
+                    AppendEscaped(out, data.data(), data.size());
+                }
+            }
+        } else if (event == trace_unknown_esc || event == trace_unknown_csi) {
+            // arg0 is intermediates, arg1 is final byte
+            uint8_t sequence[3] = {(uint8_t)(arg0 >> 8), (uint8_t)arg0, (uint8_t)arg1};
+            for (int i = 0; i < 3; i++) {
+                if (sequence[i]) {
+                    AppendEscaped(out, &sequence[i], 1);
+                }
+            }
+        } else {
+            snprintf(line, sizeof(line), "%u %llu", arg0, (unsigned long long)arg1);
+            out += line;
+        }
+        out += '\n';
+    }
+
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t size = write(out_fd, out.data() + written, out.size() - written);
+        if (size <= 0) {
+            break;
+        }
+        written += size;
+    }
+}
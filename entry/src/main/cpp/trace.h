@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <stddef.h>
+
+// lightweight binary tracing for the io and render threads
+// records raw pty bytes and events into fixed-size lock-free rings, no formatting or allocation happens there
+// formatting is deferred to TraceDump, called on demand from another thread
+
+enum trace_events {
+    // arg0: length, arg1: position in the byte ring
+    trace_pty_read,
+    // arg0: intermediates, arg1: final byte
+    trace_unknown_esc,
+    trace_unknown_csi,
+    // arg0: parameter
+    trace_unknown_sgr,
+    trace_unknown_decset,
+    trace_unknown_decrst,
+    // arg0: codepoint, arg1: weight
+    trace_missing_glyph,
+    // arg0: weight, arg1: number of glyphs
+    trace_font_loaded,
+    // arg0: frames in the last second, arg1: average msec per frame
+    trace_frame_stats,
+    // arg0: frames skipped since the last frame stats because nothing changed
+    trace_frames_skipped,
+    // arg0: pages of the glyph atlas, arg1: number of glyphs
+    trace_atlas_grow,
+    // arg0: page evicted from the glyph atlas, arg1: number of glyphs evicted
+    trace_atlas_evict,
+    // arg0: poll and read calls per MB read from the pty, arg1: bytes per wakeup, in the last second
+    trace_pty_stats,
+    // arg0: most bytes waiting in the write queue, arg1: write calls to the pty, in the last second
+    trace_write_stats,
+    // arg0: most bytes waiting in an output ring, arg1: times the pty reader stopped on a full ring, in the last second
+    trace_ring_stats,
+    NUM_TRACE_EVENTS,
+};
+
+extern std::atomic<bool> trace_enabled;
+
+void TraceBytesSlow(const uint8_t *data, size_t length);
+void TraceEventSlow(trace_events event, uint32_t arg0, uint64_t arg1);
+
+// costs a single predictable branch when tracing is off
+static inline void TraceBytes(const uint8_t *data, size_t length) {
+    if (__builtin_expect(trace_enabled.load(std::memory_order_relaxed), 0)) {
+        TraceBytesSlow(data, length);
+    }
+}
+
+static inline void TraceEvent(trace_events event, uint32_t arg0, uint64_t arg1) {
+    if (__builtin_expect(trace_enabled.load(std::memory_order_relaxed), 0)) {
+        TraceEventSlow(event, arg0, arg1);
+    }
+}
+
+void SetTraceEnabled(bool enabled);
+
+// format recorded events, oldest first, and write them to out_fd
+void TraceDump(int out_fd);
+
+#endif
@@ -1,6 +1,16 @@
-export const run: () => void;
-export const send: (content: ArrayBuffer) => void;
-export const createSurface: (id: BigInt) => void;
-export const destroySurface: (id: BigInt) => void;
-export const resizeSurface: (id: BigInt, width: number, height: number) => void;
-export const scroll: (offset: number) => void;
+export const createSession: () => number;
+export const run: (session: number, onExit?: () => void) => void;
+export const send: (session: number, content: ArrayBuffer) => void;
+export const createSurface: (session: number, id: BigInt) => void;
+export const destroySurface: (session: number, id: BigInt) => void;
+export const resizeSurface: (session: number, id: BigInt, width: number, height: number) => void;
+export const scroll: (session: number, offset: number) => void;
+export const setTrace: (enabled: boolean) => void;
+export const dumpTrace: () => void;
+export interface SearchMatch {
+  line: number;
+  column: number;
+  length: number;
+}
+export const search: (session: number, pattern: string, flags: number,
+  callback: (matches: SearchMatch[], done: boolean) => void) => boolean;